@@ -12,144 +12,2494 @@
 // algorithm)
 // - Minor amendments like giving more variables `const` and `auto` qualifiers
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <map>
 #include <optional>
+#include <queue>
 #include <ranges>
 #include <set>
 #include <sstream>
+#include <stdexcept>
+#include <system_error>
 #include <tuple>
-#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "distributed_tracing.hpp"
+#include "work_stealing_pool.hpp"
 
 using namespace std;
 
-[[maybe_unused]] string to_string(const optional<int> latency) {
-  stringstream ss;
-  if (latency) {
-    ss << *latency;
-  } else {
-    ss << "NO SUCH TRACE";
-  }
-  return ss.str();
+[[maybe_unused]] string to_string(const optional<int> latency) {
+  stringstream ss;
+  if (latency) {
+    ss << *latency;
+  } else {
+    ss << "NO SUCH TRACE";
+  }
+  return ss.str();
+}
+
+// adds n to count, reporting instead of wrapping around on overflow
+static void add_count(uint64_t& count, const uint64_t n) {
+    if (__builtin_add_overflow(count, n, &count)) {
+        throw overflow_error("trace count does not fit into 64 bits");
+    }
+}
+
+edge_parse_error::edge_parse_error(const size_t offset, const string& message)
+    : runtime_error{"byte " + std::to_string(offset) + ": " + message}, offset_{offset} {}
+
+void parse_edges(const string_view edges_str, GraphBuilder<char>& builder) {
+    const auto is_separator = [](char c) { return c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+    const auto* const begin = edges_str.data();
+    const auto* const end = begin + edges_str.size();
+    const auto* p = begin;
+    while (p != end) {
+        if (is_separator(*p)) {
+            ++p;
+            continue;
+        }
+        const auto offset = static_cast<size_t>(p - begin);
+        if (end - p < 3 || is_separator(p[1])) {
+            throw edge_parse_error{offset, "expected two vertices and a latency"};
+        }
+        int latency;
+        const auto [number_end, ec] = from_chars(p + 2, end, latency);
+        if (ec == errc::result_out_of_range) {
+            throw edge_parse_error{offset + 2, "latency out of range"};
+        }
+        if (ec != errc{} || (number_end != end && !is_separator(*number_end))) {
+            throw edge_parse_error{offset + 2, "expected a latency"};
+        }
+        builder.add_edge(p[0], p[1], latency);
+        p = number_end;
+    }
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+Graph<EdgeIterator, VertexIterator, Vertex>::Graph(const EdgeIterator& ei_begin, const EdgeIterator& ei_end)
+    : Graph{collect(ei_begin, ei_end)}
+{
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+GraphBuilder<Vertex> Graph<EdgeIterator, VertexIterator, Vertex>::collect(const EdgeIterator& ei_begin, const EdgeIterator& ei_end) {
+    GraphBuilder<Vertex> builder{};
+    for (auto it = ei_begin; it != ei_end; ++it) {
+        const auto& [nodes, latency] = *it;
+        builder.add_edge(nodes.first, nodes.second, latency);
+    }
+    return builder;
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+Graph<EdgeIterator, VertexIterator, Vertex>::Graph(GraphBuilder<Vertex> builder)
+{
+    const auto& edges = builder.edges;
+    auto& st = *storage;
+    st.vertex_names = move(builder.vertex_names);
+    build_id_index();
+
+    // counting sort by source, keeping input order within each row
+    const auto n = st.vertex_names.size();
+    st.offsets.assign(n + 1, 0);
+    for (const auto& [source, target, latency] : edges) {
+        st.offsets[source + 1] += 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        st.offsets[i + 1] += st.offsets[i];
+    }
+    vector<uint32_t> cursor{st.offsets.cbegin(), st.offsets.cend() - 1};
+    st.targets.resize(edges.size());
+    st.latencies.resize(edges.size());
+    for (const auto& [source, target, latency] : edges) {
+        st.targets[cursor[source]] = target;
+        st.latencies[cursor[source]] = latency;
+        cursor[source] += 1;
+    }
+
+    // drop repeated edges, keeping the first one like the map insertion did
+    vector<uint32_t> seen_in_row(n, numeric_limits<uint32_t>::max());
+    uint32_t out = 0;
+    for (uint32_t u = 0; u < n; u++) {
+        const auto row_begin = st.offsets[u];
+        st.offsets[u] = out;
+        for (auto i = row_begin; i < st.offsets[u + 1]; i++) {
+            if (seen_in_row[st.targets[i]] == u) {
+                continue;
+            }
+            seen_in_row[st.targets[i]] = u;
+            st.targets[out] = st.targets[i];
+            st.latencies[out] = st.latencies[i];
+            out += 1;
+        }
+    }
+    st.offsets[n] = out;
+    st.targets.resize(out);
+    st.latencies.resize(out);
+    bind_storage();
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::build_id_index() {
+    // at most half full keeps the probe sequences short
+    const auto& names = storage->vertex_names;
+    auto& slots = storage->id_slots;
+    slots.assign(max(size_t{2}, bit_ceil(2 * names.size())), 0);
+    const auto shift = 64 - countr_zero(slots.size());
+    for (uint32_t id = 0; id < names.size(); id++) {
+        auto slot = (hash<Vertex>{}(names[id]) * 0x9e3779b97f4a7c15) >> shift;
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slots.size() - 1);
+        }
+        slots[slot] = id + 1;
+    }
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::apply_updates(const span<const EdgeUpdate> updates) {
+    // the arrays are only copied, and the version only taken, once an update
+    // changes something, so that no-op batches keep sharing them and keep the
+    // entries cached for them
+    bool changed = false;
+    size_t k = 0;
+    // the common case of refreshing latencies needs no rebuild
+    for (; k < updates.size(); k++) {
+        const auto& update = updates[k];
+        const auto source = vertex_id(update.source);
+        const auto target = vertex_id(update.target);
+        const auto i = source && target ? edge_index(*source, *target) : nullopt;
+        if (!i || !update.latency) {
+            break;
+        }
+        if (latencies[*i] != *update.latency) {
+            if (!changed) {
+                make_writable();
+                changed = true;
+            }
+            drop_distribution(*i);
+            storage->latencies[*i] = *update.latency;
+        }
+    }
+
+    bool rebuild = false;
+    vector<tuple<Vertex, Vertex, optional<int>>> edges{};
+    if (k < updates.size()) {
+        // the rest goes to a list of all edges in adjacency order, where a
+        // removed edge keeps its place without a latency
+        unordered_map<pair<Vertex, Vertex>, size_t, pair_hash> positions{};
+        for (uint32_t u = 0; u < vertex_names.size(); u++) {
+            for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+                positions.emplace(pair{vertex_names[u], vertex_names[targets[i]]}, edges.size());
+                edges.emplace_back(vertex_names[u], vertex_names[targets[i]], latencies[i]);
+            }
+        }
+        for (; k < updates.size(); k++) {
+            const auto& [source, target, latency] = updates[k];
+            const auto it = positions.find(pair{source, target});
+            if (it == positions.end()) {
+                // removing an edge that is not there leaves no place behind
+                if (latency) {
+                    positions.emplace(pair{source, target}, edges.size());
+                    edges.emplace_back(source, target, latency);
+                    rebuild = true;
+                }
+                continue;
+            }
+            auto& current = get<2>(edges[it->second]);
+            rebuild |= current != latency;
+            current = latency;
+        }
+    }
+
+    if (rebuild) {
+        changed = true;
+
+        // keep the surviving old vertices in id order ahead of any new ones
+        vector<bool> keep(vertex_names.size(), false);
+        for (const auto& [source, target, latency] : edges) {
+            if (latency) {
+                for (const auto& v : {source, target}) {
+                    if (const auto id = vertex_id(v)) {
+                        keep[*id] = true;
+                    }
+                }
+            }
+        }
+        GraphBuilder<Vertex> builder{};
+        for (uint32_t id = 0; id < vertex_names.size(); id++) {
+            if (keep[id]) {
+                builder.intern(vertex_names[id]);
+            }
+        }
+        builder.reserve(edges.size());
+        for (const auto& [source, target, latency] : edges) {
+            if (latency) {
+                builder.add_edge(source, target, *latency);
+            }
+        }
+        // the histograms of the old edges whose latency stays go along,
+        // copied since the old arrays may be shared; the old edges come first
+        // in edges, in edge index order
+        vector<tuple<Vertex, Vertex, LatencyDistribution>> kept_distributions{};
+        const auto histogram_width = storage->histogram_width;
+        for (size_t i = 0; i < storage->distributions.size(); i++) {
+            const auto& distribution = storage->distributions[i];
+            if (!distribution.probabilities.empty() && get<2>(edges[i]) == latencies[i]) {
+                kept_distributions.emplace_back(get<0>(edges[i]), get<1>(edges[i]), distribution);
+            }
+        }
+        const auto generation = generation_;
+        *this = Graph{move(builder)};
+        generation_ = generation;
+        if (!kept_distributions.empty()) {
+            storage->distributions.resize(targets.size());
+            storage->histogram_width = histogram_width;
+            storage->n_distributions = kept_distributions.size();
+            for (auto& [source, target, distribution] : kept_distributions) {
+                const auto i = edge_index(*vertex_id(source), *vertex_id(target));
+                storage->distributions[*i] = move(distribution);
+            }
+        }
+    }
+    if (changed) {
+        generation_ += 1;
+        storage->version = next_version();
+    }
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::upsert_edge(const Vertex& source, const Vertex& target, const int latency) {
+    const EdgeUpdate update{source, target, latency};
+    apply_updates(span{&update, 1});
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+bool Graph<EdgeIterator, VertexIterator, Vertex>::remove_edge(const Vertex& source, const Vertex& target) {
+    const auto source_id = vertex_id(source);
+    const auto target_id = vertex_id(target);
+    if (!source_id || !target_id || !edge_index(*source_id, *target_id)) {
+        return false;
+    }
+    const EdgeUpdate update{source, target, nullopt};
+    apply_updates(span{&update, 1});
+    return true;
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::next_version() {
+    static atomic<uint64_t> last{0};
+    return last.fetch_add(1) + 1;
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::make_writable() {
+    if (storage.use_count() == 1 && !storage->mapping) {
+        return;
+    }
+    auto copy = make_shared<Storage>();
+    copy->vertex_names.assign(vertex_names.begin(), vertex_names.end());
+    copy->id_slots.assign(id_slots.begin(), id_slots.end());
+    copy->offsets.assign(offsets.begin(), offsets.end());
+    copy->targets.assign(targets.begin(), targets.end());
+    copy->latencies.assign(latencies.begin(), latencies.end());
+    copy->distributions = storage->distributions;
+    copy->histogram_width = storage->histogram_width;
+    copy->n_distributions = storage->n_distributions;
+    storage = move(copy);
+    bind_storage();
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::bind_storage() {
+    vertex_names = storage->vertex_names;
+    id_slots = storage->id_slots;
+    offsets = storage->offsets;
+    targets = storage->targets;
+    latencies = storage->latencies;
+}
+
+template <regular Vertex>
+void GraphBuilder<Vertex>::reserve(const size_t n_edges) {
+    edges.reserve(n_edges);
+}
+
+template <regular Vertex>
+void GraphBuilder<Vertex>::add_edge(const Vertex& source, const Vertex& target, const int latency) {
+    const auto source_id = intern(source);
+    const auto target_id = intern(target);
+    edges.emplace_back(source_id, target_id, latency);
+}
+
+template <regular Vertex>
+uint32_t GraphBuilder<Vertex>::intern(const Vertex& v) {
+    const auto [it, inserted] = vertex_ids.try_emplace(v, static_cast<uint32_t>(vertex_names.size()));
+    if (inserted) {
+        vertex_names.emplace_back(v);
+    }
+    return it->second;
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<uint32_t> Graph<EdgeIterator, VertexIterator, Vertex>::vertex_id(const Vertex& v) const {
+    NoStats stats{};
+    return vertex_id(v, stats);
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+template <stats_policy Stats>
+optional<uint32_t> Graph<EdgeIterator, VertexIterator, Vertex>::vertex_id(const Vertex& v, Stats& stats) const {
+    const auto shift = 64 - countr_zero(id_slots.size());
+    for (auto slot = (hash<Vertex>{}(v) * 0x9e3779b97f4a7c15) >> shift;; slot = (slot + 1) & (id_slots.size() - 1)) {
+        stats.probes(1);
+        if (id_slots[slot] == 0) {
+            return nullopt;
+        }
+        if (vertex_names[id_slots[slot] - 1] == v) {
+            return id_slots[slot] - 1;
+        }
+    }
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::path_latency(const span<const uint32_t> ids) const {
+    if (ids.empty()) {
+        return nullopt;
+    }
+    int latency = 0;
+    for (size_t k = 1; k < ids.size(); k++) {
+        if (ids[k - 1] == numeric_limits<uint32_t>::max() || ids[k] == numeric_limits<uint32_t>::max()) {
+            return nullopt;
+        }
+        const auto edge_lat = edge_latency(ids[k - 1], ids[k]);
+        if (!edge_lat) {
+            return nullopt;
+        }
+        latency += *edge_lat;
+    }
+    return latency;
+}
+
+// probabilities this small at either end of a distribution are dropped, which
+// keeps long paths from growing tails nothing is ever read from
+static constexpr double negligible_probability = 1e-12;
+
+// out = a * b as a convolution; out must not alias a or b. The inner loop has
+// no dependency between iterations, so it vectorizes.
+static void convolve(const span<const double> a, const span<const double> b, vector<double>& out) {
+    out.assign(a.size() + b.size() - 1, 0.0);
+    auto* const o = out.data();
+    for (size_t i = 0; i < a.size(); i++) {
+        const auto ai = a[i];
+        if (ai == 0) {
+            continue;
+        }
+        auto* const oi = o + i;
+        for (size_t j = 0; j < b.size(); j++) {
+            oi[j] += ai * b[j];
+        }
+    }
+}
+
+static void trim_tails(LatencyDistribution& d) {
+    auto& p = d.probabilities;
+    size_t begin = 0;
+    while (begin + 1 < p.size() && p[begin] < negligible_probability) {
+        begin++;
+    }
+    auto end = p.size();
+    while (end > begin + 1 && p[end - 1] < negligible_probability) {
+        end--;
+    }
+    if (begin != 0 || end != p.size()) {
+        p.erase(p.begin() + static_cast<ptrdiff_t>(end), p.end());
+        p.erase(p.begin(), p.begin() + static_cast<ptrdiff_t>(begin));
+        d.first_bucket += static_cast<int>(begin);
+    }
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+struct Graph<EdgeIterator, VertexIterator, Vertex>::ConvolutionScratch {
+    LatencyDistribution result{};
+    vector<double> buffer{};
+};
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+bool Graph<EdgeIterator, VertexIterator, Vertex>::path_distribution(const span<const uint32_t> ids,
+                                                                    ConvolutionScratch& scratch) const {
+    if (ids.empty()) {
+        return false;
+    }
+    const auto& distributions = storage->distributions;
+    auto& result = scratch.result;
+    result.bucket_width = max(storage->histogram_width, 1);
+    result.first_bucket = 0;
+    result.probabilities.assign(1, 1.0);
+    // the certain latencies add up exactly, and only their sum is split into
+    // whole buckets and an offset
+    int64_t point_latency = 0;
+    for (size_t k = 1; k < ids.size(); k++) {
+        if (ids[k - 1] == numeric_limits<uint32_t>::max() || ids[k] == numeric_limits<uint32_t>::max()) {
+            return false;
+        }
+        const auto i = edge_index(ids[k - 1], ids[k]);
+        if (!i) {
+            return false;
+        }
+        if (distributions.empty() || distributions[*i].probabilities.empty()) {
+            // a certain latency only moves the distribution
+            point_latency += latencies[*i];
+            continue;
+        }
+        const auto& edge = distributions[*i];
+        convolve(result.probabilities, edge.probabilities, scratch.buffer);
+        swap(result.probabilities, scratch.buffer);
+        result.first_bucket += edge.first_bucket;
+        trim_tails(result);
+    }
+    const int64_t width = result.bucket_width;
+    const auto buckets = point_latency >= 0 ? point_latency / width : -((-point_latency + width - 1) / width);
+    result.first_bucket += static_cast<int>(buckets);
+    result.offset = static_cast<int>(point_latency - buckets * width);
+    return true;
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::drop_distribution(const size_t i) {
+    auto& distributions = storage->distributions;
+    if (distributions.empty() || distributions[i].probabilities.empty()) {
+        return;
+    }
+    distributions[i] = {};
+    // without histograms the next one may have any bucket width
+    if (--storage->n_distributions == 0) {
+        distributions.clear();
+        storage->histogram_width = 0;
+    }
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+bool Graph<EdgeIterator, VertexIterator, Vertex>::set_latency_histogram(const Vertex& source, const Vertex& target,
+                                                                        const LatencyHistogram& histogram) {
+    const auto source_id = vertex_id(source);
+    const auto target_id = vertex_id(target);
+    const auto i = source_id && target_id ? edge_index(*source_id, *target_id) : nullopt;
+    if (!i) {
+        return false;
+    }
+    if (!histogram.empty() && storage->histogram_width != 0 && histogram.bucket_width() != storage->histogram_width) {
+        throw invalid_argument("all latency histograms of a graph need the same bucket width");
+    }
+    if (histogram.empty() && (storage->distributions.empty() || storage->distributions[*i].probabilities.empty())) {
+        return true;
+    }
+    make_writable();
+    auto& distributions = storage->distributions;
+    if (histogram.empty()) {
+        drop_distribution(*i);
+    } else {
+        if (distributions.empty()) {
+            distributions.resize(targets.size());
+            storage->histogram_width = histogram.bucket_width();
+        }
+        if (distributions[*i].probabilities.empty()) {
+            storage->n_distributions += 1;
+        }
+        distributions[*i] = histogram.distribution();
+    }
+    generation_ += 1;
+    storage->version = next_version();
+    return true;
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<LatencyDistribution> Graph<EdgeIterator, VertexIterator, Vertex>::latency_distribution(
+    const VertexIterator& trace_begin, const VertexIterator& trace_end) const {
+    vector<uint32_t> ids{};
+    for (auto it = trace_begin; it != trace_end; ++it) {
+        ids.push_back(vertex_id(*it).value_or(numeric_limits<uint32_t>::max()));
+    }
+    ConvolutionScratch scratch{};
+    if (!path_distribution(ids, scratch)) {
+        return nullopt;
+    }
+    return move(scratch.result);
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::latency_percentiles(const span<const Vertex> vertices,
+                                                                      const span<const size_t> trace_offsets,
+                                                                      const double p, const span<optional<int>> out,
+                                                                      const ParallelOptions& options) const {
+    if (!(p > 0 && p <= 1)) {
+        throw invalid_argument("percentile must be in (0, 1]");
+    }
+    auto* pool = options.pool != nullptr ? options.pool : &default_pool();
+    vector<uint32_t> ids(vertices.size());
+    parallel_for(pool, vertices.size(), [&](const size_t begin, const size_t end) {
+        for (auto i = begin; i < end; i++) {
+            ids[i] = vertex_id(vertices[i]).value_or(numeric_limits<uint32_t>::max());
+        }
+    });
+    parallel_for(pool, out.size(), [&](const size_t begin, const size_t end) {
+        // once grown, the buffers serve the rest of the chunk without allocating
+        ConvolutionScratch scratch{};
+        for (auto i = begin; i < end; i++) {
+            const auto path = span{ids}.subspan(trace_offsets[i], trace_offsets[i + 1] - trace_offsets[i]);
+            out[i] = path_distribution(path, scratch) ? optional<int>(scratch.result.percentile(p)) : nullopt;
+        }
+    });
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::edge_latency(const uint32_t source, const uint32_t target) const {
+    const auto i = edge_index(source, target);
+    return i ? optional<int>(latencies[*i]) : nullopt;
+}
+
+template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<uint32_t> Graph<EdgeIterator, VertexIterator, Vertex>::edge_index(const uint32_t source, const uint32_t target) const {
+    for (auto i = offsets[source]; i < offsets[source + 1]; i++) {
+        if (targets[i] == target) {
+            return i;
+        }
+    }
+    return nullopt;
+}
+
+LatencyHistogram::LatencyHistogram(const int bucket_width) : width{bucket_width} {
+    if (bucket_width <= 0) {
+        throw invalid_argument("bucket width must be positive");
+    }
+}
+
+void LatencyHistogram::add(const int latency, const uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+    const auto bucket = max(latency, 0) / width;
+    if (counts_.empty()) {
+        first = bucket;
+    } else if (bucket < first) {
+        counts_.insert(counts_.begin(), static_cast<size_t>(first - bucket), 0);
+        first = bucket;
+    }
+    const auto i = static_cast<size_t>(bucket - first);
+    if (i >= counts_.size()) {
+        counts_.resize(i + 1, 0);
+    }
+    counts_[i] += count;
+    total_ += count;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    if (other.width != width) {
+        throw invalid_argument("cannot merge histograms of different bucket widths");
+    }
+    for (size_t i = 0; i < other.counts_.size(); i++) {
+        add((other.first + static_cast<int>(i)) * width, other.counts_[i]);
+    }
+}
+
+LatencyDistribution LatencyHistogram::distribution() const {
+    LatencyDistribution ret{width, first, vector<double>(counts_.size())};
+    for (size_t i = 0; i < counts_.size(); i++) {
+        ret.probabilities[i] = static_cast<double>(counts_[i]) / static_cast<double>(total_);
+    }
+    return ret;
+}
+
+int LatencyDistribution::percentile(const double p) const {
+    if (!(p > 0 && p <= 1)) {
+        throw invalid_argument("percentile must be in (0, 1]");
+    }
+    // rounding leaves the sum of the probabilities a little off 1
+    double cumulative = 0;
+    for (size_t i = 0; i < probabilities.size(); i++) {
+        cumulative += probabilities[i];
+        if (cumulative >= p - 1e-9) {
+            return (first_bucket + static_cast<int>(i)) * bucket_width + offset;
+        }
+    }
+    return (first_bucket + static_cast<int>(probabilities.size()) - 1) * bucket_width + offset;
+}
+
+double LatencyDistribution::mean() const {
+    double ret = 0;
+    for (size_t i = 0; i < probabilities.size(); i++) {
+        ret += probabilities[i] * (first_bucket + static_cast<double>(i));
+    }
+    return ret * bucket_width + offset;
+}
+
+void QueryStats::enter(const QueryPhase phase) {
+    const auto now = chrono::steady_clock::now();
+    if (this->phase) {
+        phase_time[static_cast<size_t>(*this->phase)] += now - phase_start;
+    }
+    this->phase = phase;
+    phase_start = now;
+}
+
+void QueryStats::expanded(const size_t hop, const uint64_t n) {
+    if (expanded_per_hop.size() <= hop) {
+        expanded_per_hop.resize(hop + 1, 0);
+    }
+    expanded_per_hop[hop] += n;
+}
+
+void QueryStats::finish() {
+    if (phase) {
+        phase_time[static_cast<size_t>(*phase)] += chrono::steady_clock::now() - phase_start;
+        phase = nullopt;
+    }
+    auto& totals = query_stats_totals();
+    totals.queries.fetch_add(1, memory_order_relaxed);
+    for (const auto n : expanded_per_hop) {
+        totals.expanded.fetch_add(n, memory_order_relaxed);
+    }
+    auto peak = totals.peak_frontier.load(memory_order_relaxed);
+    while (peak < peak_frontier && !totals.peak_frontier.compare_exchange_weak(peak, peak_frontier, memory_order_relaxed)) {
+    }
+    totals.pruned_by_latency.fetch_add(n_pruned_by_latency, memory_order_relaxed);
+    totals.pruned_by_missing_edge.fetch_add(n_pruned_by_missing_edge, memory_order_relaxed);
+    totals.hash_probes.fetch_add(hash_probes, memory_order_relaxed);
+    totals.allocations.fetch_add(allocations, memory_order_relaxed);
+    for (size_t k = 0; k < n_query_phases; k++) {
+        totals.phase_nanoseconds[k].fetch_add(static_cast<uint64_t>(phase_time[k].count()), memory_order_relaxed);
+    }
+}
+
+QueryStatsTotals& query_stats_totals() {
+    static QueryStatsTotals totals{};
+    return totals;
+}
+
+ServiceId ServiceNames::intern(const string_view name) {
+    if (const auto it = ids.find(name); it != ids.cend()) {
+        return ServiceId{it->second};
+    }
+    const auto id = static_cast<uint32_t>(names.size());
+    const auto it = ids.emplace(string{name}, id).first;
+    names.push_back(&it->first);
+    return ServiceId{id};
+}
+
+optional<ServiceId> ServiceNames::find(const string_view name) const {
+    const auto it = ids.find(name);
+    return it == ids.cend() ? nullopt : optional<ServiceId>(ServiceId{it->second});
+}
+
+vector<string_view> ServiceNames::names_of(const span<const ServiceId> ids) const {
+    vector<string_view> ret{};
+    ret.reserve(ids.size());
+    ranges::transform(ids, back_inserter(ret), [this](ServiceId id) { return name(id); });
+    return ret;
+}
+
+void parse_service_edges(const string_view edges_str, ServiceNames& names, GraphBuilder<ServiceId>& builder) {
+    const auto is_separator = [](char c) { return c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+    size_t p = 0;
+    while (p < edges_str.size()) {
+        if (is_separator(edges_str[p])) {
+            p += 1;
+            continue;
+        }
+        const auto record_end = ranges::find_if(edges_str.substr(p), is_separator) - edges_str.begin();
+        const auto record = edges_str.substr(p, record_end - p);
+        const auto arrow = record.find('>');
+        const auto colon = record.rfind(':');
+        if (arrow == string_view::npos || arrow == 0) {
+            throw edge_parse_error{p, "expected a source service"};
+        }
+        if (colon == string_view::npos || colon <= arrow + 1) {
+            throw edge_parse_error{p + arrow + 1, "expected a target service"};
+        }
+        const auto source = record.substr(0, arrow);
+        const auto target = record.substr(arrow + 1, colon - arrow - 1);
+        if (target.find('>') != string_view::npos) {
+            throw edge_parse_error{p + arrow + 1, "expected a target service"};
+        }
+        int latency;
+        const auto number = record.substr(colon + 1);
+        const auto [number_end, ec] = from_chars(number.data(), number.data() + number.size(), latency);
+        if (ec == errc::result_out_of_range) {
+            throw edge_parse_error{p + colon + 1, "latency out of range"};
+        }
+        if (ec != errc{} || number_end != number.data() + number.size()) {
+            throw edge_parse_error{p + colon + 1, "expected a latency"};
+        }
+        const auto source_id = names.intern(source);
+        builder.add_edge(source_id, names.intern(target), latency);
+        p = record_end;
+    }
+}
+
+ServiceTopology from_service_edges_str(const string_view edges_str) {
+    ServiceNames names{};
+    GraphBuilder<ServiceId> builder{};
+    parse_service_edges(edges_str, names, builder);
+    return ServiceTopology{move(names), ServiceGraph{move(builder)}};
+}
+
+CharGraph from_edges_str(const string &edges_str) {
+    GraphBuilder<char> builder{};
+    parse_edges(edges_str, builder);
+    return CharGraph{move(builder)};
+}
+
+// A whole file mapped read-only into memory, unmapped on destruction.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const string& path) {
+        const auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw system_error{errno, generic_category(), path};
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            const auto error = errno;
+            close(fd);
+            throw system_error{error, generic_category(), path};
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size == 0) {
+            close(fd);
+            return;
+        }
+        auto* const mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            throw system_error{errno, generic_category(), path};
+        }
+        data = static_cast<const char*>(mapped);
+    }
+    ~MappedFile() {
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+CharGraph from_edges_file(const string& path) {
+    const MappedFile file{path};
+    GraphBuilder<char> builder{};
+    // every record is at least three bytes plus a separator
+    builder.reserve(file.size / 4);
+    parse_edges(string_view{file.data, file.size}, builder);
+    return CharGraph{move(builder)};
+}
+
+// The fixed-size start of a graph snapshot. It is followed by the vertex
+// table, the vertex id index, the CSR offsets, targets and latencies, the
+// offsets of the service names into the name bytes and the name bytes, each
+// padded to 8 bytes. The id index depends on std::hash of the vertex type, so
+// a snapshot is only portable between builds that agree on it.
+struct SnapshotHeader {
+    array<char, 8> magic;
+    uint32_t version;
+    uint32_t vertex_size;
+    uint64_t n_vertices;
+    uint64_t n_slots;
+    uint64_t n_edges;
+    uint64_t n_names;
+    uint64_t names_bytes;
+    // of everything after the header
+    uint64_t checksum;
+};
+
+static constexpr array<char, 8> SNAPSHOT_MAGIC{'D', 'T', 'G', 'R', 'A', 'P', 'H', '\0'};
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+static constexpr size_t padded(const size_t n_bytes) {
+    return (n_bytes + 7) / 8 * 8;
+}
+
+// a word-at-a-time hash, fast enough to verify a snapshot on every load; a
+// partial last word is padded with zeros like the section it ends
+static uint64_t snapshot_checksum(uint64_t seed, const char* data, const size_t n_bytes) {
+    for (size_t i = 0; i < n_bytes; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, min(size_t{8}, n_bytes - i));
+        seed = rotl(seed ^ word, 29) * 0x9e3779b97f4a7c15;
+    }
+    return seed;
+}
+
+void write_snapshot(const ServiceTopology& topology, const string& path) {
+    topology.graph.write_snapshot(path, &topology.names);
+}
+
+ServiceTopology load_service_snapshot(const string& path, const bool verify) {
+    ServiceNames names{};
+    auto graph = ServiceGraph::load_snapshot(path, &names, verify);
+    return ServiceTopology{move(names), move(graph)};
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::average_latency(const VertexIterator& trace_begin, const VertexIterator& trace_end) const {
+    NoStats stats{};
+    return average_latency(trace_begin, trace_end, stats);
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+template <stats_policy Stats>
+optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::average_latency(const VertexIterator& trace_begin,
+                                                                           const VertexIterator& trace_end,
+                                                                           Stats& stats) const {
+    stats.enter(QueryPhase::search);
+    if (trace_begin == trace_end) {
+        stats.finish();
+        return nullopt;
+    }
+    int latency = 0;
+    auto source = vertex_id(*trace_begin, stats);
+    for (auto it = next(trace_begin); it != trace_end; ++it) {
+        const auto target = vertex_id(*it, stats);
+        const auto edge_lat = source && target ? edge_latency(*source, *target) : nullopt;
+        if (!edge_lat) {
+            stats.pruned_by_missing_edge();
+            stats.finish();
+            return nullopt;
+        }
+        latency += *edge_lat;
+        source = target;
+    }
+    stats.finish();
+    return latency;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::average_latencies(const span<const Vertex> vertices,
+                                                                    const span<const size_t> trace_offsets,
+                                                                    const span<optional<int>> out,
+                                                                    const ParallelOptions& options) const {
+    // translating every vertex to its dense id once up front leaves only array
+    // accesses for the per-trace work
+    auto* pool = options.pool != nullptr ? options.pool : &default_pool();
+    vector<uint32_t> ids(vertices.size());
+    parallel_for(pool, vertices.size(), [&](const size_t begin, const size_t end) {
+        for (auto i = begin; i < end; i++) {
+            ids[i] = vertex_id(vertices[i]).value_or(numeric_limits<uint32_t>::max());
+        }
+    });
+    parallel_for(pool, out.size(), [&](const size_t begin, const size_t end) {
+        for (auto i = begin; i < end; i++) {
+            out[i] = path_latency(span{ids}.subspan(trace_offsets[i], trace_offsets[i + 1] - trace_offsets[i]));
+        }
+    });
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<vector<Vertex>> Graph<EdgeIterator, VertexIterator, Vertex>::traces(const Vertex start_node, const Vertex end_node, const int min_hops, const int max_hops,
+                                   const int max_latency) const {
+    NoStats stats{};
+    return traces(start_node, end_node, min_hops, max_hops, max_latency, stats);
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+template <stats_policy Stats>
+vector<vector<Vertex>> Graph<EdgeIterator, VertexIterator, Vertex>::traces(const Vertex start_node, const Vertex end_node,
+                                                                           const int min_hops, const int max_hops,
+                                                                           const int max_latency, Stats& stats) const {
+    return search_traces(start_node, end_node, min_hops, max_hops, max_latency, QueryBudget{}, stats).traces;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+typename Graph<EdgeIterator, VertexIterator, Vertex>::TraceResult
+Graph<EdgeIterator, VertexIterator, Vertex>::traces(const Vertex start_node, const Vertex end_node, const int min_hops,
+                                                    const int max_hops, const int max_latency,
+                                                    const QueryBudget& budget) const {
+    NoStats stats{};
+    return search_traces(start_node, end_node, min_hops, max_hops, max_latency, budget, stats);
+}
+
+// Whether a query has to stop for its budget's deadline or stop token.
+static Truncation interruption(const QueryBudget& budget) {
+    if (budget.stop.stop_requested()) {
+        return Truncation::cancelled;
+    }
+    if (budget.deadline && chrono::steady_clock::now() >= *budget.deadline) {
+        return Truncation::deadline;
+    }
+    return Truncation::none;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+template <stats_policy Stats>
+typename Graph<EdgeIterator, VertexIterator, Vertex>::TraceResult
+Graph<EdgeIterator, VertexIterator, Vertex>::search_traces(const Vertex start_node, const Vertex end_node,
+                                                           const int min_hops, const int max_hops,
+                                                           const int max_latency, const QueryBudget& budget,
+                                                           Stats& stats) const {
+    TraceResult result{};
+    auto& ret = result.traces;
+    auto& truncation = result.truncation;
+    stats.enter(QueryPhase::lookup);
+    const auto start_id = vertex_id(start_node, stats);
+    const auto end_id = vertex_id(end_node, stats);
+    if (!start_id || !end_id) {
+        stats.finish();
+        return result;
+    }
+    // every path in the frontier is an arena node pointing at the node of its
+    // prefix, so extending a path by an edge appends a single node and the
+    // vertices of a path are only collected when it is emitted
+    struct PathNode {
+        uint32_t parent;
+        uint32_t vertex;
+        int latency;
+    };
+    // an edge is only taken if the trace can still reach end_node in time
+    const auto bounded = max_latency != numeric_limits<int>::max();
+    stats.enter(QueryPhase::bounds);
+    const auto remaining = bounded ? latencies_to(*end_id, max_latency) : vector<int>{};
+    stats.enter(QueryPhase::search);
+    vector<PathNode> arena{{numeric_limits<uint32_t>::max(), *start_id, 0}};
+    stats.allocation();
+    size_t frontier_begin = 0;
+    int n_hops = 0;
+    uint64_t n_expanded = 0;
+    while (n_hops < max_hops && (truncation = interruption(budget)) == Truncation::none) {
+        // for all paths in the frontier, add all paths extended by an out-edge
+        // of their last node if they don't have a too high average latency
+        const auto frontier_end = arena.size();
+        const auto capacity = arena.capacity();
+        stats.expanded(n_hops, frontier_end - frontier_begin);
+        for (auto p = frontier_begin; p < frontier_end && truncation == Truncation::none; p++) {
+            const auto [parent, u, latency] = arena[p];
+            if (offsets[u] == offsets[u + 1]) {
+                stats.pruned_by_missing_edge();
+            }
+            for (auto i = offsets[u]; i < offsets[u + 1] && truncation == Truncation::none; i++) {
+                if (latencies[i] <= max_latency - latency &&
+                    (!bounded || remaining[targets[i]] <= max_latency - latency - latencies[i])) {
+                    if (n_expanded == budget.max_expanded) {
+                        truncation = Truncation::max_expanded;
+                        break;
+                    }
+                    arena.push_back({static_cast<uint32_t>(p), targets[i], latency + latencies[i]});
+                    if (++n_expanded % 1024 == 0) {
+                        truncation = interruption(budget);
+                    }
+                } else {
+                    stats.pruned_by_latency();
+                }
+            }
+        }
+        if constexpr (Stats::enabled) {
+            if (arena.capacity() != capacity) {
+                stats.allocation();
+            }
+            stats.frontier(arena.size() - frontier_end);
+        }
+        frontier_begin = frontier_end;
+        if (arena.size() == frontier_begin) {
+            break;
+        }
+
+        n_hops += 1;
+        if (n_hops >= min_hops) {
+            // the traces of a frontier cut short by the budget still count
+            for (auto p = frontier_begin; p < arena.size(); p++) {
+                if (arena[p].vertex != *end_id) {
+                    continue;
+                }
+                if (ret.size() == budget.max_results) {
+                    truncation = Truncation::max_results;
+                    break;
+                }
+                vector<Vertex> trace(n_hops + 1);
+                auto node = static_cast<uint32_t>(p);
+                for (auto k = n_hops; k >= 0; k--) {
+                    trace[k] = vertex_names[arena[node].vertex];
+                    node = arena[node].parent;
+                }
+                if constexpr (Stats::enabled) {
+                    stats.allocation();
+                    if (ret.size() == ret.capacity()) {
+                        stats.allocation();
+                    }
+                }
+                ret.emplace_back(move(trace));
+            }
+        }
+        if (truncation != Truncation::none) {
+            break;
+        }
+    }
+    stats.finish();
+    return result;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<vector<Vertex>> Graph<EdgeIterator, VertexIterator, Vertex>::traces(const Vertex start_node, const Vertex end_node,
+                                                                           const int min_hops, const int max_hops,
+                                                                           const int max_latency,
+                                                                           const ParallelOptions& options) const {
+    vector<vector<Vertex>> ret{};
+    const auto start_id = vertex_id(start_node);
+    const auto end_id = vertex_id(end_node);
+    if (!start_id || !end_id) {
+        return ret;
+    }
+
+    // the paths of up to split_hops hops in depth-first order, each either a
+    // trace of its own or the root of a subtree to search; this is the order
+    // in which lazy_traces() would reach them
+    struct Task {
+        vector<uint32_t> prefix;
+        int latency;
+        bool expand;
+    };
+    vector<Task> tasks{};
+    shared_ptr<const vector<int>> remaining{};
+    if (max_latency != numeric_limits<int>::max()) {
+        remaining = make_shared<const vector<int>>(latencies_to(*end_id, max_latency));
+    }
+    vector<uint32_t> prefix{*start_id};
+    const auto split_hops = clamp(options.split_hops, 0, max(max_hops, 0));
+    const auto collect = [&](const auto& self, const int latency) -> void {
+        const auto n_hops = static_cast<int>(prefix.size()) - 1;
+        if (n_hops > 0 && n_hops >= min_hops && prefix.back() == *end_id) {
+            tasks.push_back({prefix, latency, false});
+        }
+        if (n_hops == split_hops) {
+            if (n_hops < max_hops) {
+                tasks.push_back({prefix, latency, true});
+            }
+            return;
+        }
+        const auto u = prefix.back();
+        for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+            if (latencies[i] <= max_latency - latency &&
+                (!remaining || (*remaining)[targets[i]] <= max_latency - latency - latencies[i])) {
+                prefix.push_back(targets[i]);
+                self(self, latency + latencies[i]);
+                prefix.pop_back();
+            }
+        }
+    };
+    collect(collect, 0);
+
+    auto& pool = options.pool != nullptr ? *options.pool : default_pool();
+    vector<vector<vector<Vertex>>> buffers(options.deterministic_order ? tasks.size() : pool.size());
+    pool.run(tasks.size(), [&](const size_t k, const unsigned worker) {
+        auto& out = buffers[options.deterministic_order ? k : worker];
+        const auto& task = tasks[k];
+        if (!task.expand) {
+            auto& trace = out.emplace_back();
+            ranges::transform(task.prefix, back_inserter(trace), [this](uint32_t id) { return vertex_names[id]; });
+            return;
+        }
+        for (const auto trace :
+             TraceView{*this, task.prefix, task.latency, end_id, min_hops, max_hops, max_latency, remaining}) {
+            out.emplace_back(trace.begin(), trace.end());
+        }
+    });
+    for (auto& buffer : buffers) {
+        ranges::move(buffer, back_inserter(ret));
+    }
+    return ret;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+typename Graph<EdgeIterator, VertexIterator, Vertex>::TraceView
+Graph<EdgeIterator, VertexIterator, Vertex>::lazy_traces(const Vertex start_node, const Vertex end_node, const int min_hops,
+                                                         const int max_hops, const int max_latency) const {
+    const auto start_id = vertex_id(start_node);
+    const auto end_id = vertex_id(end_node);
+    shared_ptr<const vector<int>> remaining{};
+    if (start_id && end_id && max_latency != numeric_limits<int>::max()) {
+        remaining = make_shared<const vector<int>>(latencies_to(*end_id, max_latency));
+    }
+    return TraceView{*this, start_id ? vector{*start_id} : vector<uint32_t>{}, 0, end_id, min_hops, max_hops,
+                     max_latency, move(remaining)};
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+Graph<EdgeIterator, VertexIterator, Vertex>::TraceView::TraceView(const Graph& graph, const vector<uint32_t>& prefix,
+                                                                  const int latency, const optional<uint32_t> end_id,
+                                                                  const int min_hops, const int max_hops,
+                                                                  const int max_latency,
+                                                                  shared_ptr<const vector<int>> latencies_to)
+    : graph{&graph}, min_hops{min_hops}, max_hops{max_hops}, max_latency{max_latency},
+      latencies_to{move(latencies_to)} {
+    if (!prefix.empty() && end_id) {
+        this->end_id = *end_id;
+        base_hops = static_cast<int>(prefix.size()) - 1;
+        frames.push_back({prefix.back(), graph.offsets[prefix.back()], latency});
+        ranges::transform(prefix, back_inserter(path), [&graph](uint32_t id) { return graph.vertex_names[id]; });
+    }
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+typename Graph<EdgeIterator, VertexIterator, Vertex>::TraceView::iterator
+Graph<EdgeIterator, VertexIterator, Vertex>::TraceView::begin() {
+    if (!started) {
+        started = true;
+        advance();
+    }
+    return iterator{this};
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::TraceView::advance() {
+    // resumes the depth-first search where the last trace was yielded and
+    // stops at the next one, or with no frames left once it is exhausted
+    while (!frames.empty()) {
+        auto& top = frames.back();
+        const auto n_hops = base_hops + static_cast<int>(frames.size()) - 1;
+        if (n_hops >= max_hops || top.next_edge == graph->offsets[top.vertex + 1]) {
+            frames.pop_back();
+            path.pop_back();
+            continue;
+        }
+        const auto i = top.next_edge++;
+        const auto v = graph->targets[i];
+        if (graph->latencies[i] > max_latency - top.latency ||
+            (latencies_to && (*latencies_to)[v] > max_latency - top.latency - graph->latencies[i])) {
+            continue;
+        }
+        frames.push_back({v, graph->offsets[v], top.latency + graph->latencies[i]});
+        path.emplace_back(graph->vertex_names[v]);
+        if (n_hops + 1 >= min_hops && v == end_id) {
+            return;
+        }
+    }
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_traces(const Vertex start_node, const Vertex end_node, const int min_hops,
+                                                                   const int max_hops, const int max_latency) const {
+    return count_traces(start_node, end_node, min_hops, max_hops, max_latency, nullptr);
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_traces(const Vertex start_node, const Vertex end_node, const int min_hops,
+                                                                   const int max_hops, const int max_latency,
+                                                                   const ParallelOptions& options) const {
+    return count_traces(start_node, end_node, min_hops, max_hops, max_latency,
+                        options.pool != nullptr ? options.pool : &default_pool());
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_traces(const Vertex start_node, const Vertex end_node, const int min_hops,
+                                                                   const int max_hops, const int max_latency,
+                                                                   WorkStealingPool* pool) const {
+    const auto start_id = vertex_id(start_node);
+    const auto end_id = vertex_id(end_node);
+    if (!start_id || !end_id || max_hops < 1 || max_latency < 0) {
+        return 0;
+    }
+    if (max_latency == numeric_limits<int>::max()) {
+        if (counts_by_matrix_power(max_hops)) {
+            return count_by_matrix_power(*start_id, *end_id, min_hops, max_hops, pool);
+        }
+        return count_by_hops(in_edges(), *start_id, *end_id, min_hops, max_hops, pool);
+    }
+    const auto in = in_edges();
+
+    // with all latencies at least min_latency a trace within the budget has at
+    // most max_latency / min_latency hops, so the hop bounds may not matter
+    const auto min_latency = latencies.empty() ? 1 : ranges::min(latencies);
+    if (min_hops <= 1 && min_latency > 0 && max_hops > max_latency / min_latency) {
+        return count_by_budget(in, *start_id, *end_id, max_latency, pool);
+    }
+    return count_by_hops_and_budget(in, *start_id, *end_id, min_hops, max_hops, max_latency, pool);
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+bool Graph<EdgeIterator, VertexIterator, Vertex>::counts_by_matrix_power(const int max_hops) const {
+    // a hop costs n + m with dynamic programming, a squaring about 4 n^3 with
+    // the shadow, and the matrices have to fit into memory easily
+    const auto n = static_cast<double>(vertex_names.size());
+    const auto squarings = bit_width(static_cast<unsigned>(max_hops));
+    return n <= 1024 && 4 * n * n * n * squarings < static_cast<double>(max_hops) * (n + targets.size());
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<uint64_t> Graph<EdgeIterator, VertexIterator, Vertex>::count_traces(const span<const TraceQuery> queries,
+                                                                           const ParallelOptions& options) const {
+    auto* pool = options.pool != nullptr ? options.pool : &default_pool();
+    vector<uint64_t> ret(queries.size(), 0);
+    // the queries the shared dynamic program takes, by start
+    vector<tuple<uint32_t, size_t, uint32_t>> shared{};
+    for (size_t q = 0; q < queries.size(); q++) {
+        const auto& [start_node, end_node, min_hops, max_hops, max_latency] = queries[q];
+        const auto start_id = vertex_id(start_node);
+        const auto end_id = vertex_id(end_node);
+        if (!start_id || !end_id || max_hops < 1 || max_latency < 0) {
+            continue;
+        }
+        if (max_latency != numeric_limits<int>::max() || counts_by_matrix_power(max_hops)) {
+            ret[q] = count_traces(start_node, end_node, min_hops, max_hops, max_latency, pool);
+        } else {
+            shared.emplace_back(*start_id, q, *end_id);
+        }
+    }
+    if (shared.empty()) {
+        return ret;
+    }
+    ranges::sort(shared);
+    const auto in = in_edges();
+    vector<uint32_t> sources{};
+    vector<size_t> group{};
+    vector<size_t> lanes{};
+    vector<uint32_t> end_ids(queries.size());
+    for (const auto& [source, q, target] : shared) {
+        end_ids[q] = target;
+    }
+    for (size_t k = 0; k < shared.size(); k++) {
+        const auto source = get<0>(shared[k]);
+        if (sources.empty() || sources.back() != source) {
+            sources.push_back(source);
+        }
+        group.push_back(get<1>(shared[k]));
+        lanes.push_back(sources.size() - 1);
+        // a pass ends with 64 starts or the last query
+        if (k + 1 == shared.size() || (sources.size() == 64 && get<0>(shared[k + 1]) != source)) {
+            vector<TraceQuery> group_queries{};
+            vector<uint32_t> group_ends{};
+            vector<uint64_t> counts(group.size(), 0);
+            for (const auto q : group) {
+                group_queries.push_back(queries[q]);
+                group_ends.push_back(end_ids[q]);
+            }
+            count_by_hops(in, sources, group_queries, lanes, group_ends, counts, pool);
+            for (size_t i = 0; i < group.size(); i++) {
+                ret[group[i]] = counts[i];
+            }
+            sources.clear();
+            group.clear();
+            lanes.clear();
+        }
+    }
+    return ret;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::count_by_hops(const InEdges& in, const span<const uint32_t> sources,
+                                                               const span<const TraceQuery> queries,
+                                                               const span<const size_t> lanes,
+                                                               const span<const uint32_t> end_ids,
+                                                               const span<uint64_t> ret, WorkStealingPool* pool) const {
+    // walks[v * width + lane] is the number of traces of the current hop count
+    // from the lane's start that end in v, and reached[v] the bitset of the
+    // lanes where that is not 0. A vertex only reads the lanes of its
+    // in-neighbours that reached any, with a branch-free loop over the lanes
+    // that vectorizes.
+    const auto n = vertex_names.size();
+    const auto width = sources.size();
+    vector<int> lane_max_hops(width, 0);
+    for (size_t i = 0; i < queries.size(); i++) {
+        lane_max_hops[lanes[i]] = max(lane_max_hops[lanes[i]], queries[i].max_hops);
+    }
+    // slack[v * width + lane] is the last hop count at which a walk of the
+    // lane may end in v and still become a trace of one of its queries (-1 if
+    // none); later walks are dropped so that they cannot overflow
+    vector<uint32_t> ends(end_ids.begin(), end_ids.end());
+    ranges::sort(ends);
+    ends.erase(unique(ends.begin(), ends.end()), ends.end());
+    vector<vector<int>> hops_to_end(ends.size());
+    parallel_for(pool, ends.size(), [&](const size_t begin, const size_t end) {
+        for (auto t = begin; t < end; t++) {
+            hops_to_end[t] = hops_to(in, ends[t]);
+        }
+    });
+    vector<int> slack(n * width, -1);
+    for (size_t i = 0; i < queries.size(); i++) {
+        const auto& to_end = hops_to_end[static_cast<size_t>(ranges::lower_bound(ends, end_ids[i]) - ends.begin())];
+        for (size_t v = 0; v < n; v++) {
+            if (to_end[v] <= queries[i].max_hops) {
+                auto& s = slack[v * width + lanes[i]];
+                s = max(s, queries[i].max_hops - to_end[v]);
+            }
+        }
+    }
+    vector<uint64_t> walks(n * width, 0);
+    vector<uint64_t> new_walks(n * width, 0);
+    vector<uint64_t> reached(n, 0);
+    vector<uint64_t> new_reached(n, 0);
+    for (size_t lane = 0; lane < width; lane++) {
+        walks[sources[lane] * width + lane] = 1;
+        reached[sources[lane]] |= uint64_t{1} << lane;
+    }
+    // lanes past their hop bound drop out, so that they cannot overflow
+    uint64_t live = width == 64 ? ~uint64_t{0} : (uint64_t{1} << width) - 1;
+    const auto max_hops = ranges::max(lane_max_hops);
+    for (int n_hops = 1; n_hops <= max_hops && live != 0; n_hops++) {
+        atomic<uint64_t> overflowed{0};
+        parallel_for(pool, n, [&](const size_t begin, const size_t end) {
+            uint64_t overflow = 0;
+            for (auto v = begin; v < end; v++) {
+                auto* const w = new_walks.data() + v * width;
+                fill(w, w + width, 0);
+                uint64_t any = 0;
+                uint64_t wrapped = 0;
+                for (auto i = in.offsets[v]; i < in.offsets[v + 1]; i++) {
+                    const auto u = in.sources[i];
+                    if ((reached[u] & live) == 0) {
+                        continue;
+                    }
+                    any |= reached[u];
+                    const auto* const x = walks.data() + u * width;
+                    for (size_t lane = 0; lane < width; lane++) {
+                        const auto sum = w[lane] + x[lane];
+                        wrapped |= static_cast<uint64_t>(sum < x[lane]) << lane;
+                        w[lane] = sum;
+                    }
+                }
+                uint64_t mask = 0;
+                if (any != 0) {
+                    const auto* const s = slack.data() + v * width;
+                    uint64_t kept = 0;
+                    for (size_t lane = 0; lane < width; lane++) {
+                        const auto keep = n_hops <= s[lane];
+                        w[lane] = keep ? w[lane] : 0;
+                        kept |= static_cast<uint64_t>(keep) << lane;
+                        mask |= static_cast<uint64_t>(w[lane] != 0) << lane;
+                    }
+                    overflow |= wrapped & kept;
+                }
+                new_reached[v] = mask & live;
+            }
+            if (overflow != 0) {
+                overflowed.fetch_or(overflow);
+            }
+        });
+        if ((overflowed.load() & live) != 0) {
+            throw overflow_error("trace count does not fit into 64 bits");
+        }
+        swap(walks, new_walks);
+        swap(reached, new_reached);
+        if (ranges::all_of(reached, [](uint64_t r) { return r == 0; })) {
+            break;
+        }
+        for (size_t i = 0; i < queries.size(); i++) {
+            if (n_hops >= queries[i].min_hops && n_hops <= queries[i].max_hops) {
+                add_count(ret[i], walks[end_ids[i] * width + lanes[i]]);
+            }
+        }
+        for (size_t lane = 0; lane < width; lane++) {
+            if (lane_max_hops[lane] == n_hops) {
+                live &= ~(uint64_t{1} << lane);
+            }
+        }
+    }
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<int> Graph<EdgeIterator, VertexIterator, Vertex>::hops_to(const InEdges& in, const uint32_t target) const {
+    vector<int> ret(vertex_names.size(), numeric_limits<int>::max());
+    vector<uint32_t> queue{target};
+    ret[target] = 0;
+    for (size_t k = 0; k < queue.size(); k++) {
+        const auto v = queue[k];
+        for (auto i = in.offsets[v]; i < in.offsets[v + 1]; i++) {
+            if (ret[in.sources[i]] == numeric_limits<int>::max()) {
+                ret[in.sources[i]] = ret[v] + 1;
+                queue.push_back(in.sources[i]);
+            }
+        }
+    }
+    return ret;
 }
 
-pair<vector<pair<pair<char, char>, int>>::const_iterator,
-        vector<pair<pair<char, char>, int>>::const_iterator> parse_edges_str(string_view edges_str, vector<pair<pair<char, char>, int>>& edges_parsed) {
-    vector<string> edges{};
-    string token;
-    string edges_str_new;
-    ranges::copy(edges_str, back_inserter(edges_str_new));
-    ranges::replace(edges_str_new, ',', ' ');
-    istringstream ss{edges_str_new};
-    istream_iterator<string> it{ss};
-    copy(it, istream_iterator<string>{}, back_inserter(edges));
-    ranges::transform(edges, back_inserter(edges_parsed), [](const string &e) {
-        char a = e[0];
-        char b = e[1];
-        return make_pair<pair<char, char>, int>(pair<char, char>(a, b), stoi(e.substr(2)));
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<vector<vector<Vertex>>> Graph<EdgeIterator, VertexIterator, Vertex>::traces(const span<const TraceQuery> queries,
+                                                                                   const ParallelOptions& options) const {
+    auto* pool = options.pool != nullptr ? options.pool : &default_pool();
+    vector<vector<vector<Vertex>>> ret(queries.size());
+    // the queries that can have any traces by start, and their distinct ends
+    vector<tuple<uint32_t, size_t, uint32_t>> by_start{};
+    vector<uint32_t> ends{};
+    for (size_t q = 0; q < queries.size(); q++) {
+        const auto start_id = vertex_id(queries[q].start_node);
+        const auto end_id = vertex_id(queries[q].end_node);
+        if (start_id && end_id && queries[q].max_hops >= 1 && queries[q].max_latency >= 0) {
+            by_start.emplace_back(*start_id, q, *end_id);
+            ends.push_back(*end_id);
+        }
+    }
+    ranges::sort(by_start);
+    ranges::sort(ends);
+    ends.erase(unique(ends.begin(), ends.end()), ends.end());
+    const auto end_index = [&](const uint32_t end_id) {
+        return static_cast<size_t>(ranges::lower_bound(ends, end_id) - ends.begin());
+    };
+
+    // how many hops and how much latency away every vertex is from every end,
+    // the latter up to the highest bound of the queries that have one
+    vector<int> max_latencies(ends.size(), -1);
+    for (const auto& [start_id, q, end_id] : by_start) {
+        if (queries[q].max_latency != numeric_limits<int>::max()) {
+            auto& bound = max_latencies[end_index(end_id)];
+            bound = max(bound, queries[q].max_latency);
+        }
+    }
+    const auto in = in_edges();
+    vector<vector<int>> hops_to_end(ends.size());
+    vector<vector<int>> latencies_to_end(ends.size());
+    parallel_for(pool, ends.size(), [&](const size_t begin, const size_t end) {
+        for (auto t = begin; t < end; t++) {
+            hops_to_end[t] = hops_to(in, ends[t]);
+            if (max_latencies[t] >= 0) {
+                latencies_to_end[t] = latencies_to(ends[t], max_latencies[t]);
+            }
+        }
+    });
+
+    // groups of up to 64 queries with the same start
+    vector<pair<size_t, size_t>> groups{};
+    for (size_t k = 0; k < by_start.size(); k++) {
+        if (groups.empty() || get<0>(by_start[groups.back().first]) != get<0>(by_start[k]) ||
+            k - groups.back().first == 64) {
+            groups.emplace_back(k, k);
+        }
+        groups.back().second = k + 1;
+    }
+    struct Member {
+        size_t query;
+        uint32_t end_id;
+        const int* hops_to;
+        const int* latencies_to;
+    };
+    // as in search_traces(), but every path also has the bitset of the
+    // members of its group it can still become a trace of
+    struct PathNode {
+        uint32_t parent;
+        uint32_t vertex;
+        int latency;
+        uint64_t members;
+    };
+    parallel_for(pool, groups.size(), [&](const size_t groups_begin, const size_t groups_end) {
+        vector<Member> members{};
+        vector<PathNode> arena{};
+        for (auto g = groups_begin; g < groups_end; g++) {
+            const auto [first, last] = groups[g];
+            members.clear();
+            int max_hops = 0;
+            for (auto k = first; k < last; k++) {
+                const auto [start_id, q, end_id] = by_start[k];
+                const auto t = end_index(end_id);
+                members.push_back({q, end_id, hops_to_end[t].data(),
+                                   queries[q].max_latency == numeric_limits<int>::max() ? nullptr
+                                                                                         : latencies_to_end[t].data()});
+                max_hops = max(max_hops, queries[q].max_hops);
+            }
+            // whether member b can still use a path of n_hops hops ending in v
+            const auto can_reach = [&](const size_t b, const uint32_t v, const int n_hops, const int latency) {
+                const auto& query = queries[members[b].query];
+                if (members[b].hops_to[v] > query.max_hops - n_hops) {
+                    return false;
+                }
+                return members[b].latencies_to == nullptr || members[b].latencies_to[v] <= query.max_latency - latency;
+            };
+            const auto start_id = get<0>(by_start[first]);
+            uint64_t all = 0;
+            for (size_t b = 0; b < members.size(); b++) {
+                all |= static_cast<uint64_t>(can_reach(b, start_id, 0, 0)) << b;
+            }
+            arena.assign(1, {numeric_limits<uint32_t>::max(), start_id, 0, all});
+            size_t frontier_begin = 0;
+            for (int n_hops = 1; n_hops <= max_hops && frontier_begin < arena.size(); n_hops++) {
+                const auto frontier_end = arena.size();
+                for (auto p = frontier_begin; p < frontier_end; p++) {
+                    const auto [parent, u, latency, path_members] = arena[p];
+                    for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+                        if (latencies[i] > numeric_limits<int>::max() - latency) {
+                            continue;
+                        }
+                        const auto v = targets[i];
+                        uint64_t next_members = 0;
+                        for (auto rest = path_members; rest != 0; rest &= rest - 1) {
+                            const auto b = static_cast<size_t>(countr_zero(rest));
+                            next_members |= static_cast<uint64_t>(can_reach(b, v, n_hops, latency + latencies[i])) << b;
+                        }
+                        if (next_members != 0) {
+                            arena.push_back({static_cast<uint32_t>(p), v, latency + latencies[i], next_members});
+                        }
+                    }
+                }
+                frontier_begin = frontier_end;
+                for (auto p = frontier_begin; p < arena.size(); p++) {
+                    optional<vector<Vertex>> trace{};
+                    for (auto rest = arena[p].members; rest != 0; rest &= rest - 1) {
+                        const auto& member = members[static_cast<size_t>(countr_zero(rest))];
+                        if (member.end_id != arena[p].vertex || n_hops < queries[member.query].min_hops) {
+                            continue;
+                        }
+                        if (!trace) {
+                            trace.emplace(n_hops + 1);
+                            auto node = static_cast<uint32_t>(p);
+                            for (auto k = n_hops; k >= 0; k--) {
+                                (*trace)[k] = vertex_names[arena[node].vertex];
+                                node = arena[node].parent;
+                            }
+                        }
+                        ret[member.query].push_back(*trace);
+                    }
+                }
+            }
+        }
     });
-    return {edges_parsed.cbegin(), edges_parsed.cend()};
+    return ret;
 }
 
-template<input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
-Graph<EdgeIterator, VertexIterator, Vertex>::Graph(const EdgeIterator& ei_begin, const EdgeIterator& ei_end) : graph{ei_begin, ei_end}
-{
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_traces_by_matrix_power(const Vertex start_node,
+                                                                                   const Vertex end_node,
+                                                                                   const int min_hops,
+                                                                                   const int max_hops,
+                                                                                   const ParallelOptions& options) const {
+    const auto start_id = vertex_id(start_node);
+    const auto end_id = vertex_id(end_node);
+    if (!start_id || !end_id || max_hops < 1) {
+        return 0;
+    }
+    return count_by_matrix_power(*start_id, *end_id, min_hops, max_hops,
+                                 options.pool != nullptr ? options.pool : &default_pool());
+}
+
+// Walk counts of a square matrix in row-major order, both modulo 2^64 and as
+// a double shadow of the true counts. Products of the wrapped counts are
+// exact modulo 2^64 however large the true counts get, and the shadow tells
+// whether a result is the true count. The shadow saturates at 2^80, far
+// beyond any count that fits, so that it never becomes infinite and 0 * inf
+// never turns a result into NaN.
+struct CountMatrix {
+    size_t n;
+    vector<uint64_t> counts;
+    vector<double> shadow;
+
+    explicit CountMatrix(const size_t n) : n{n}, counts(n * n, 0), shadow(n * n, 0.0) {}
+};
+
+static constexpr double shadow_limit = 0x1p80;
+
+// z = x * y + add, or x * y without add: the nonzero entries of each row of x
+// scale rows of y, so a sparse x makes this a sparse times dense product. The
+// rows are split across the pool, and the columns of y into blocks that stay
+// in cache while every row of x passes over them. The inner loop over a block
+// is a branch-free multiply-add, which vectorizes.
+static void multiply_counts(const CountMatrix& x, const CountMatrix& y, const CountMatrix* add, CountMatrix& z,
+                            WorkStealingPool* pool) {
+    constexpr size_t block = 256;
+    const auto n = x.n;
+    parallel_for(pool, n, [&](const size_t begin, const size_t end) {
+        vector<uint32_t> nonzero{};
+        for (auto i = begin; i < end; i++) {
+            nonzero.clear();
+            for (size_t k = 0; k < n; k++) {
+                if (x.shadow[i * n + k] != 0.0) {
+                    nonzero.push_back(static_cast<uint32_t>(k));
+                }
+            }
+            auto* const z_counts = z.counts.data() + i * n;
+            auto* const z_shadow = z.shadow.data() + i * n;
+            for (size_t j0 = 0; j0 < n; j0 += block) {
+                const auto j1 = min(n, j0 + block);
+                for (auto j = j0; j < j1; j++) {
+                    z_counts[j] = add != nullptr ? add->counts[i * n + j] : 0;
+                    z_shadow[j] = add != nullptr ? add->shadow[i * n + j] : 0.0;
+                }
+                for (const auto k : nonzero) {
+                    const auto a_count = x.counts[i * n + k];
+                    const auto a_shadow = x.shadow[i * n + k];
+                    const auto* const y_counts = y.counts.data() + k * n;
+                    const auto* const y_shadow = y.shadow.data() + k * n;
+                    for (auto j = j0; j < j1; j++) {
+                        z_counts[j] += a_count * y_counts[j];
+                        z_shadow[j] = min(z_shadow[j] + a_shadow * y_shadow[j], shadow_limit);
+                    }
+                }
+            }
+        }
+    });
 }
 
-Graph<vector<pair<pair<char, char>, int>>::const_iterator, vector<char>::const_iterator, char> from_edges_str(const string &edges_str) {
-    vector<pair<pair<char, char>, int>> edges_parsed{};
-    auto [ei_begin, ei_end] = parse_edges_str(edges_str, edges_parsed);
-    return Graph<vector<pair<pair<char, char>, int>>::const_iterator, vector<char>::const_iterator, char>{ei_begin, ei_end};
+// A row vector of walk counts in the same representation as CountMatrix.
+struct CountRow {
+    vector<uint64_t> counts;
+    vector<double> shadow;
+};
+
+// x * m + add, or x * m without add.
+static CountRow multiply_counts(const CountRow& x, const CountMatrix& m, const CountRow* add) {
+    const auto n = m.n;
+    CountRow ret = add != nullptr ? *add : CountRow{vector<uint64_t>(n, 0), vector<double>(n, 0.0)};
+    for (size_t k = 0; k < n; k++) {
+        if (x.shadow[k] == 0.0) {
+            continue;
+        }
+        for (size_t j = 0; j < n; j++) {
+            ret.counts[j] += x.counts[k] * m.counts[k * n + j];
+            ret.shadow[j] = min(ret.shadow[j] + x.shadow[k] * m.shadow[k * n + j], shadow_limit);
+        }
+    }
+    return ret;
 }
 
 template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
-optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::average_latency(VertexIterator& trace_begin, VertexIterator& trace_end) const {
-    int latency = 0;
-    vector<pair<Vertex, Vertex>> edges{};
-    transform(trace_begin, trace_end - 1, trace_begin + 1,
-              back_inserter(edges), [](Vertex a, Vertex b) { return pair<Vertex, Vertex>(a, b); });
-    auto f = ranges::find_if(edges, [&](const auto& edge){
-        if (!graph.contains(edge)) {
-            return true;
-        }
-        latency += (*graph.find(edge)).second;
-        return false;
-    });
-    return f == edges.cend() ? optional<int>(latency) : nullopt;
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_by_matrix_power(const uint32_t source, const uint32_t target,
+                                                                            const int min_hops, const int max_hops,
+                                                                            WorkStealingPool* pool) const {
+    // the count is e_source A^low S(c) e_target for the adjacency A, the lowest
+    // hop count low and the number c of hop counts, where S(c) is the sum of
+    // A^0 .. A^(c - 1). S(c) is the upper right block of M^c for the augmented
+    // M = [[A, I], [0, I]], so the row vector (x, y) = (e_source, 0) times M^c
+    // is (e_source A^c, e_source S(c)). Squaring M only needs its two upper
+    // blocks P and Q: [[P, Q], [0, I]]^2 = [[P P, P Q + Q], [0, I]]. Powers of
+    // A commute, so multiplying (x, y) by A^low can be interleaved with M^c,
+    // bit by bit of both exponents, while P and Q are squared.
+    const auto n = vertex_names.size();
+    const auto low = static_cast<uint64_t>(max(min_hops, 1));
+    if (low > static_cast<uint64_t>(max_hops)) {
+        return 0;
+    }
+    auto c = static_cast<uint64_t>(max_hops) - low + 1;
+    auto l = low;
+
+    CountMatrix p{n};
+    CountMatrix q{n};
+    for (uint32_t u = 0; u < n; u++) {
+        for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+            p.counts[u * n + targets[i]] = 1;
+            p.shadow[u * n + targets[i]] = 1.0;
+        }
+        q.counts[u * n + u] = 1;
+        q.shadow[u * n + u] = 1.0;
+    }
+    CountRow x{vector<uint64_t>(n, 0), vector<double>(n, 0.0)};
+    CountRow y{vector<uint64_t>(n, 0), vector<double>(n, 0.0)};
+    x.counts[source] = 1;
+    x.shadow[source] = 1.0;
+
+    CountMatrix scratch{n};
+    while (c != 0 || l != 0) {
+        if ((c & 1) != 0) {
+            y = multiply_counts(x, q, &y);
+            x = multiply_counts(x, p, nullptr);
+        }
+        if ((l & 1) != 0) {
+            x = multiply_counts(x, p, nullptr);
+            y = multiply_counts(y, p, nullptr);
+        }
+        c >>= 1;
+        l >>= 1;
+        if (c != 0 || l != 0) {
+            // Q is only needed while there are bits of c left
+            if (c != 0) {
+                multiply_counts(p, q, &q, scratch, pool);
+                swap(q, scratch);
+            }
+            multiply_counts(p, p, nullptr, scratch, pool);
+            swap(p, scratch);
+        }
+    }
+
+    // the wrapped count is the true one if it is where the shadow says, up to
+    // the rounding of the shadow; otherwise the true count wrapped around
+    const auto count = y.counts[target];
+    const auto approximate = y.shadow[target];
+    if (approximate >= 0x1p64 * (1 + 1e-6) ||
+        abs(static_cast<double>(count) - approximate) > approximate * 1e-6) {
+        throw overflow_error("trace count does not fit into 64 bits");
+    }
+    return count;
 }
 
 template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
-optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::average_latency(const VertexIterator& trace_begin, const VertexIterator& trace_end) const {
-    int latency = 0;
-    vector<pair<Vertex, Vertex>> edges{};
-    transform(trace_begin, trace_end - 1, trace_begin + 1,
-              back_inserter(edges), [](Vertex a, Vertex b) { return pair<Vertex, Vertex>(a, b); });
-    auto f = ranges::find_if(edges, [&](const auto& edge){
-        if (!graph.contains(edge)) {
-            return true;
-        }
-        latency += (*graph.find(edge)).second;
-        return false;
-    });
-    return f == edges.cend() ? optional<int>(latency) : nullopt;
+typename Graph<EdgeIterator, VertexIterator, Vertex>::InEdges Graph<EdgeIterator, VertexIterator, Vertex>::in_edges() const {
+    const auto n = vertex_names.size();
+    InEdges in{vector<uint32_t>(n + 1, 0), vector<uint32_t>(targets.size()), vector<int>(targets.size())};
+    for (const auto v : targets) {
+        in.offsets[v + 1] += 1;
+    }
+    for (size_t v = 0; v < n; v++) {
+        in.offsets[v + 1] += in.offsets[v];
+    }
+    vector<uint32_t> cursor{in.offsets.cbegin(), in.offsets.cend() - 1};
+    for (uint32_t u = 0; u < n; u++) {
+        for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+            const auto k = cursor[targets[i]]++;
+            in.sources[k] = u;
+            in.latencies[k] = latencies[i];
+        }
+    }
+    return in;
 }
 
 template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
-vector<vector<Vertex>> Graph<EdgeIterator, VertexIterator, Vertex>::traces(const Vertex start_node, const Vertex end_node, const int min_hops, const int max_hops,
-                                   const int max_latency) const {
-    vector<vector<Vertex>> frontier{{start_node}};
-    vector<vector<Vertex>> ret{};
-    int n_hops = 0;
-    while (n_hops < max_hops) {
-        // for all node lists in the frontier, add all node lists with the new
-        // nodes connected by edges added if they don't have a too high average
-        // latency
-        // check if we should use emplace and move semantics
-        vector<vector<Vertex>> new_frontier{};
-        for (const auto& nodes : frontier)
-            for (const auto dest : vertices()) {
-                vector<Vertex> nodes_copy{nodes};
-                nodes_copy.emplace_back(dest);
-                new_frontier.emplace_back(nodes_copy);
-            }
-
-
-        erase_if(new_frontier, [this, &max_latency](auto& nodes) {
-            auto nodes_begin = cbegin(nodes);
-            auto nodes_end = cend(nodes);
-            return !graph.contains(pair(nodes[nodes.size() - 2], nodes.back())) || *average_latency(nodes_begin, nodes_end) > max_latency;
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_by_hops(const InEdges& in, const uint32_t source, const uint32_t target,
+                                                                    const int min_hops, const int max_hops,
+                                                                    WorkStealingPool* pool) const {
+    // walks[v] is the number of traces of the current hop count ending in v,
+    // so every hop is one sparse matrix-vector product with the adjacency.
+    // Only the vertices from which the target is within the remaining hops
+    // keep theirs, so that walks which can never become a trace do not
+    // overflow.
+    const auto n = vertex_names.size();
+    const auto to_target = hops_to(in, target);
+    vector<uint64_t> walks(n, 0);
+    vector<uint64_t> new_walks(n, 0);
+    walks[source] = 1;
+    uint64_t count = 0;
+    for (int n_hops = 1; n_hops <= max_hops; n_hops++) {
+        parallel_for(pool, n, [&](const size_t begin, const size_t end) {
+            for (auto v = begin; v < end; v++) {
+                uint64_t w = 0;
+                if (to_target[v] <= max_hops - n_hops) {
+                    for (auto i = in.offsets[v]; i < in.offsets[v + 1]; i++) {
+                        add_count(w, walks[in.sources[i]]);
+                    }
+                }
+                new_walks[v] = w;
+            }
         });
-        frontier = new_frontier;
-        if (new_frontier.empty()) {
+        swap(walks, new_walks);
+        if (ranges::all_of(walks, [](uint64_t w) { return w == 0; })) {
             break;
         }
+        if (n_hops >= min_hops) {
+            add_count(count, walks[target]);
+        }
+    }
+    return count;
+}
 
-        n_hops += 1;
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_by_budget(const InEdges& in, const uint32_t source, const uint32_t target,
+                                                                      const int max_latency, WorkStealingPool* pool) const {
+    // walks[b * n + v] is the number of traces of one or more hops ending in v
+    // that have used up b of the latency budget; every latency is positive, so
+    // a row only depends on rows with a smaller b
+    const auto n = vertex_names.size();
+    const auto budget = static_cast<size_t>(max_latency);
+    vector<uint64_t> walks((budget + 1) * n, 0);
+    uint64_t count = 0;
+    for (size_t b = 1; b <= budget; b++) {
+        parallel_for(pool, n, [&](const size_t begin, const size_t end) {
+            for (auto v = begin; v < end; v++) {
+                uint64_t w = 0;
+                for (auto i = in.offsets[v]; i < in.offsets[v + 1]; i++) {
+                    const auto latency = static_cast<size_t>(in.latencies[i]);
+                    if (latency > b) {
+                        continue;
+                    }
+                    if (latency == b && in.sources[i] == source) {
+                        add_count(w, 1);
+                    }
+                    add_count(w, walks[(b - latency) * n + in.sources[i]]);
+                }
+                walks[b * n + v] = w;
+            }
+        });
+        add_count(count, walks[b * n + target]);
+    }
+    return count;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+uint64_t Graph<EdgeIterator, VertexIterator, Vertex>::count_by_hops_and_budget(const InEdges& in, const uint32_t source,
+                                                                               const uint32_t target, const int min_hops,
+                                                                               const int max_hops, const int max_latency,
+                                                                               WorkStealingPool* pool) const {
+    // the (vertex, used budget) table of count_by_budget, advanced one hop at a
+    // time so that the hop bounds can be applied; it is stored vertex-major so
+    // that an in-edge adds one contiguous row to another
+    const auto n = vertex_names.size();
+    const auto width = static_cast<size_t>(max_latency) + 1;
+    // only the states from which the target is still within the budget are
+    // kept, so every walk left can become a trace
+    const auto remaining = latencies_to(target, max_latency);
+    const auto live_width = [&](const size_t v) {
+        return remaining[v] > max_latency ? 0 : width - static_cast<size_t>(remaining[v]);
+    };
+    if (live_width(source) == 0) {
+        return 0;
+    }
+    vector<uint64_t> walks(n * width, 0);
+    vector<uint64_t> new_walks(n * width, 0);
+    walks[source * width] = 1;
+    uint64_t count = 0;
+    for (int n_hops = 1; n_hops <= max_hops; n_hops++) {
+        // more hops than (vertex, used budget) states means some walk repeats
+        // a state, i.e. runs through a zero-latency cycle from which the
+        // target is within the budget, as often as it likes
+        if (max_hops == numeric_limits<int>::max() && static_cast<size_t>(n_hops) > n * width) {
+            throw overflow_error("unbounded number of traces through a zero-latency cycle");
+        }
+        parallel_for(pool, n, [&](const size_t begin, const size_t end) {
+            ranges::fill(new_walks.begin() + begin * width, new_walks.begin() + end * width, 0);
+            for (auto v = begin; v < end; v++) {
+                const auto live = live_width(v);
+                for (auto i = in.offsets[v]; i < in.offsets[v + 1]; i++) {
+                    const auto latency = static_cast<size_t>(in.latencies[i]);
+                    const auto* from = &walks[in.sources[i] * width];
+                    auto* to = &new_walks[v * width];
+                    for (auto b = latency; b < live; b++) {
+                        add_count(to[b], from[b - latency]);
+                    }
+                }
+            }
+        });
+        swap(walks, new_walks);
+        if (ranges::all_of(walks, [](uint64_t w) { return w == 0; })) {
+            break;
+        }
         if (n_hops >= min_hops) {
-            vector<vector<Vertex>> filtered_frontier{};
-            ranges::copy_if(frontier,
-                    back_inserter(filtered_frontier),
-                    [&](const auto &nodes) { return (nodes.back() == end_node); });
-            ret.insert(ret.cend(), filtered_frontier.cbegin(),
-                       filtered_frontier.cend());
+            for (size_t b = 0; b < width; b++) {
+                add_count(count, walks[target * width + b]);
+            }
+        }
+    }
+    return count;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<int> Graph<EdgeIterator, VertexIterator, Vertex>::latencies_to(const uint32_t target, const int max_latency) const {
+    const auto in = in_edges();
+    vector<int> dist(vertex_names.size(), numeric_limits<int>::max());
+    vector<bool> settled(vertex_names.size(), false);
+    priority_queue<pair<int, uint32_t>, vector<pair<int, uint32_t>>, greater<>> heap{};
+    dist[target] = 0;
+    heap.emplace(0, target);
+    while (!heap.empty()) {
+        const auto [latency, v] = heap.top();
+        heap.pop();
+        if (latency > max_latency) {
+            break;
+        }
+        if (settled[v]) {
+            continue;
+        }
+        settled[v] = true;
+        for (auto i = in.offsets[v]; i < in.offsets[v + 1]; i++) {
+            const auto u = in.sources[i];
+            if (in.latencies[i] <= numeric_limits<int>::max() - latency && latency + in.latencies[i] < dist[u]) {
+                dist[u] = latency + in.latencies[i];
+                heap.emplace(dist[u], u);
+            }
+        }
+    }
+    return dist;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::shortest_paths(const uint32_t source, const uint32_t target, vector<int>& dist,
+                                                                 vector<uint32_t>& parent) const {
+    const auto n = vertex_names.size();
+    dist.assign(n, numeric_limits<int>::max());
+    parent.assign(n, numeric_limits<uint32_t>::max());
+    vector<bool> settled(n, false);
+    priority_queue<pair<int, uint32_t>, vector<pair<int, uint32_t>>, greater<>> heap{};
+
+    // seeding with the out-edges instead of the source itself lets the source
+    // be reached again, which is what a cycle query needs
+    const auto relax = [&](uint32_t u, int latency) {
+        for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+            const auto v = targets[i];
+            if (latencies[i] > numeric_limits<int>::max() - latency || latency + latencies[i] >= dist[v]) {
+                continue;
+            }
+            dist[v] = latency + latencies[i];
+            parent[v] = u;
+            heap.emplace(dist[v], v);
+        }
+    };
+    relax(source, 0);
+    while (!heap.empty()) {
+        const auto [latency, u] = heap.top();
+        heap.pop();
+        if (settled[u]) {
+            continue;
+        }
+        settled[u] = true;
+        if (u == target) {
+            break;
+        }
+        relax(u, latency);
+    }
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<pair<vector<Vertex>, int>> Graph<EdgeIterator, VertexIterator, Vertex>::shortest_trace(const Vertex start_node,
+                                                                                                const Vertex end_node) const {
+    const auto start_id = vertex_id(start_node);
+    const auto end_id = vertex_id(end_node);
+    if (!start_id || !end_id) {
+        return nullopt;
+    }
+    vector<int> dist{};
+    vector<uint32_t> parent{};
+    shortest_paths(*start_id, *end_id, dist, parent);
+    if (dist[*end_id] == numeric_limits<int>::max()) {
+        return nullopt;
+    }
+
+    // the parent chain of end leads back to start; for a cycle end is start,
+    // so the first step is taken before testing for it
+    vector<Vertex> trace{vertex_names[*end_id]};
+    auto v = *end_id;
+    do {
+        v = parent[v];
+        trace.emplace_back(vertex_names[v]);
+    } while (v != *start_id);
+    ranges::reverse(trace);
+    return pair{move(trace), dist[*end_id]};
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::shortest_latency(const Vertex start_node, const Vertex end_node) const {
+    const auto trace = shortest_trace(start_node, end_node);
+    return trace ? optional<int>(trace->second) : nullopt;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<pair<vector<Vertex>, int>> Graph<EdgeIterator, VertexIterator, Vertex>::k_shortest_traces(
+    const Vertex start_node, const Vertex end_node, const size_t k, const bool simple_only) const {
+    const auto start_id = vertex_id(start_node);
+    const auto end_id = vertex_id(end_node);
+    if (!start_id || !end_id || k == 0) {
+        return {};
+    }
+    const auto found = simple_only ? k_shortest_simple(*start_id, *end_id, k) : k_shortest_walks(*start_id, *end_id, k);
+    vector<pair<vector<Vertex>, int>> ret{};
+    ret.reserve(found.size());
+    for (const auto& [path, latency] : found) {
+        vector<Vertex> trace{};
+        trace.reserve(path.size());
+        for (const auto id : path) {
+            trace.push_back(vertex_names[id]);
+        }
+        ret.emplace_back(move(trace), latency);
+    }
+    return ret;
+}
+
+// The state of the spur searches of one k_shortest_traces() call. Only the
+// vertices a search reached are reset after it, so a search that stops early
+// does not pay for the size of the graph.
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+struct Graph<EdgeIterator, VertexIterator, Vertex>::SpurSearch {
+    // latencies_to() the target, which blocking vertices or edges can only
+    // raise, so it stays a consistent A* estimate for every spur
+    vector<int> to_target{};
+    vector<int> dist{};
+    vector<uint32_t> parent{};
+    vector<bool> blocked{};
+    vector<uint32_t> reached{};
+    vector<pair<int64_t, uint32_t>> heap{};
+};
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::spur_path(const uint32_t source, const uint32_t target,
+                                                                     const span<const uint32_t> cut_targets,
+                                                                     const int max_latency, SpurSearch& search,
+                                                                     vector<uint32_t>& path) const {
+    auto& [to_target, dist, parent, blocked, reached, heap] = search;
+    const auto relax = [&](const uint32_t u, const int latency) {
+        for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+            const auto v = targets[i];
+            if ((blocked[v] && v != target) || to_target[v] == numeric_limits<int>::max() ||
+                latencies[i] > numeric_limits<int>::max() - latency ||
+                latency + latencies[i] >= dist[v] || int64_t{latency} + latencies[i] + to_target[v] > max_latency) {
+                continue;
+            }
+            if (u == source && ranges::find(cut_targets, v) != cut_targets.end()) {
+                continue;
+            }
+            if (dist[v] == numeric_limits<int>::max()) {
+                reached.push_back(v);
+            }
+            dist[v] = latency + latencies[i];
+            parent[v] = u;
+            heap.emplace_back(int64_t{dist[v]} + to_target[v], v);
+            ranges::push_heap(heap, greater<>{});
+        }
+    };
+    // as in shortest_paths(), seeding with the out-edges lets a cycle end in
+    // source; the target is never expanded, so no trace passes through it,
+    // and its distance is final once nothing in the heap is lower
+    relax(source, 0);
+    while (!heap.empty() && heap.front().first < dist[target]) {
+        ranges::pop_heap(heap, greater<>{});
+        const auto [estimate, u] = heap.back();
+        heap.pop_back();
+        if (estimate == int64_t{dist[u]} + to_target[u] && u != target) {
+            relax(u, dist[u]);
+        }
+    }
+    const auto ret = dist[target] == numeric_limits<int>::max() ? nullopt : optional<int>(dist[target]);
+    if (ret) {
+        const auto begin = path.size();
+        auto v = target;
+        do {
+            path.push_back(v);
+            v = parent[v];
+        } while (v != source);
+        path.push_back(source);
+        reverse(path.begin() + static_cast<ptrdiff_t>(begin), path.end());
+    }
+    for (const auto v : reached) {
+        dist[v] = numeric_limits<int>::max();
+    }
+    reached.clear();
+    heap.clear();
+    return ret;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<pair<vector<uint32_t>, int>> Graph<EdgeIterator, VertexIterator, Vertex>::k_shortest_simple(
+    const uint32_t source, const uint32_t target, const size_t k) const {
+    const auto n = vertex_names.size();
+    SpurSearch search{latencies_to(target, numeric_limits<int>::max()), vector<int>(n, numeric_limits<int>::max()),
+                      vector<uint32_t>(n), vector<bool>(n, false)};
+    vector<pair<vector<uint32_t>, int>> ret{};
+    vector<uint32_t> path{};
+    const auto first = spur_path(source, target, {}, numeric_limits<int>::max(), search, path);
+    if (!first) {
+        return ret;
+    }
+    ret.emplace_back(move(path), *first);
+    // ordered by latency and then by vertex ids, which also drops a candidate
+    // found again from another spur; the value is where it leaves the trace
+    // it was found from. Only as many as traces are still missing are kept,
+    // and no spur needs to look for anything slower than the slowest of them.
+    map<pair<int, vector<uint32_t>>, size_t> candidates{};
+    vector<uint32_t> cut_targets{};
+    size_t deviation = 0;
+    while (ret.size() < k) {
+        // every vertex of the previous trace but the last one is a spur: the
+        // candidates share its root up to the spur and then leave it on an
+        // edge no earlier trace with the same root took. As Lawler noted, the
+        // spurs before where the previous trace left its own parent only find
+        // candidates found for the parent already.
+        const auto previous = ret.back().first;
+        int root_latency = 0;
+        for (size_t i = 0; i < deviation; i++) {
+            root_latency += *edge_latency(previous[i], previous[i + 1]);
+        }
+        const auto missing = k - ret.size();
+        for (auto i = deviation; i + 1 < previous.size(); i++) {
+            const auto spur = previous[i];
+            const auto max_latency = candidates.size() < missing ? numeric_limits<int>::max()
+                                                                 : prev(candidates.end())->first.first - 1;
+            if (max_latency < root_latency) {
+                break;
+            }
+            const auto root = span{previous}.first(i + 1);
+            cut_targets.clear();
+            for (const auto& [trace, latency] : ret) {
+                if (trace.size() > i + 1 && ranges::equal(span{trace}.first(i + 1), root)) {
+                    cut_targets.push_back(trace[i + 1]);
+                }
+            }
+            for (const auto v : root) {
+                search.blocked[v] = true;
+            }
+            path.assign(root.begin(), root.end() - 1);
+            const auto spur_latency = spur_path(spur, target, cut_targets, max_latency - root_latency, search, path);
+            for (const auto v : root) {
+                search.blocked[v] = false;
+            }
+            if (spur_latency && *spur_latency <= numeric_limits<int>::max() - root_latency) {
+                const auto [it, inserted] = candidates.try_emplace(pair{root_latency + *spur_latency, path}, i);
+                it->second = min(it->second, i);
+                if (candidates.size() > missing) {
+                    candidates.erase(prev(candidates.end()));
+                }
+            }
+            root_latency += *edge_latency(spur, previous[i + 1]);
+        }
+        if (candidates.empty()) {
+            break;
+        }
+        auto next = candidates.extract(candidates.begin());
+        deviation = next.mapped();
+        ret.emplace_back(move(next.key().second), next.key().first);
+    }
+    return ret;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+vector<pair<vector<uint32_t>, int>> Graph<EdgeIterator, VertexIterator, Vertex>::k_shortest_walks(
+    const uint32_t source, const uint32_t target, const size_t k) const {
+    // The i-th time a vertex is settled is by its i-th lowest-latency trace,
+    // so settling every vertex up to k times finds the k lowest-latency traces
+    // to target. Ordering the heap by the latency plus the lowest latency left
+    // to target keeps that true and only settles the vertices of traces about
+    // as fast as the k-th one. Every heap entry is a trace, as its last
+    // vertex, latency and the entry of the trace it extends.
+    const auto to_target = latencies_to(target, numeric_limits<int>::max());
+    vector<tuple<uint32_t, int, uint32_t>> entries{{source, 0, numeric_limits<uint32_t>::max()}};
+    vector<size_t> n_settled(vertex_names.size(), 0);
+    priority_queue<pair<int64_t, uint32_t>, vector<pair<int64_t, uint32_t>>, greater<>> heap{};
+    const auto relax = [&](const uint32_t entry) {
+        const auto [u, latency, _] = entries[entry];
+        for (auto i = offsets[u]; i < offsets[u + 1]; i++) {
+            const auto v = targets[i];
+            if (n_settled[v] == k || to_target[v] == numeric_limits<int>::max() ||
+                latencies[i] > numeric_limits<int>::max() - latency) {
+                continue;
+            }
+            heap.emplace(int64_t{latency} + latencies[i] + to_target[v], static_cast<uint32_t>(entries.size()));
+            entries.emplace_back(v, latency + latencies[i], entry);
+        }
+    };
+    vector<pair<vector<uint32_t>, int>> ret{};
+    relax(0);
+    while (!heap.empty() && ret.size() < k) {
+        const auto entry = heap.top().second;
+        heap.pop();
+        const auto [v, latency, _] = entries[entry];
+        if (n_settled[v] == k) {
+            continue;
+        }
+        n_settled[v] += 1;
+        if (v == target) {
+            vector<uint32_t> path{};
+            for (auto e = entry; e != numeric_limits<uint32_t>::max(); e = get<2>(entries[e])) {
+                path.push_back(get<0>(entries[e]));
+            }
+            ranges::reverse(path);
+            ret.emplace_back(move(path), latency);
+        }
+        relax(entry);
+    }
+    return ret;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::write_snapshot(const string& path, const ServiceNames* names) const
+    requires is_trivially_copyable_v<Vertex> {
+    SnapshotHeader header{SNAPSHOT_MAGIC, SNAPSHOT_VERSION, sizeof(Vertex), vertex_names.size(), id_slots.size(),
+                          targets.size(), 0, 0, 0};
+    vector<uint64_t> name_offsets{0};
+    string name_bytes{};
+    if (names != nullptr) {
+        for (uint32_t i = 0; i < names->size(); i++) {
+            name_bytes += names->name(ServiceId{i});
+            name_offsets.push_back(name_bytes.size());
+        }
+        header.n_names = names->size();
+        header.names_bytes = name_bytes.size();
+    }
+
+    // the snapshot replaces the file only once complete, so that a reader
+    // never maps a partial one and graphs loaded from the old file keep it
+    static atomic<uint64_t> n_written{0};
+    const auto temp_path = path + ".tmp." + to_string(getpid()) + "." + to_string(n_written++);
+    ofstream out{temp_path, ios::binary | ios::trunc};
+    if (!out) {
+        throw system_error{errno, generic_category(), temp_path};
+    }
+    const auto fail = [&](const string& what) {
+        const auto error = errno;
+        out.close();
+        unlink(temp_path.c_str());
+        throw system_error{error, generic_category(), what};
+    };
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t checksum = 0;
+    const auto write_section = [&](const void* data, const size_t n_bytes) {
+        static constexpr array<char, 8> zeros{};
+        checksum = snapshot_checksum(checksum, static_cast<const char*>(data), n_bytes);
+        out.write(static_cast<const char*>(data), static_cast<streamsize>(n_bytes));
+        out.write(zeros.data(), static_cast<streamsize>(padded(n_bytes) - n_bytes));
+    };
+    write_section(vertex_names.data(), vertex_names.size_bytes());
+    write_section(id_slots.data(), id_slots.size_bytes());
+    write_section(offsets.data(), offsets.size_bytes());
+    write_section(targets.data(), targets.size_bytes());
+    write_section(latencies.data(), latencies.size_bytes());
+    write_section(name_offsets.data(), header.n_names > 0 ? name_offsets.size() * sizeof(uint64_t) : 0);
+    write_section(name_bytes.data(), name_bytes.size());
+    header.checksum = checksum;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!out.flush()) {
+        fail(temp_path);
+    }
+    out.close();
+    if (!out) {
+        fail(temp_path);
+    }
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        fail(path);
+    }
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+Graph<EdgeIterator, VertexIterator, Vertex> Graph<EdgeIterator, VertexIterator, Vertex>::load_snapshot(const string& path,
+                                                                                                       ServiceNames* names,
+                                                                                                       const bool verify)
+    requires is_trivially_copyable_v<Vertex> {
+    const auto file = make_shared<const MappedFile>(path);
+    const auto invalid = [&path](const string& reason) { return runtime_error{path + ": " + reason}; };
+    SnapshotHeader header{};
+    if (file->size < sizeof(header)) {
+        throw invalid("not a graph snapshot");
+    }
+    memcpy(&header, file->data, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC) {
+        throw invalid("not a graph snapshot");
+    }
+    if (header.version != SNAPSHOT_VERSION || header.vertex_size != sizeof(Vertex)) {
+        throw invalid("unsupported snapshot version or vertex type");
+    }
+    if (header.n_vertices >= numeric_limits<uint32_t>::max() || header.n_edges > numeric_limits<uint32_t>::max() ||
+        header.n_slots <= header.n_vertices || !has_single_bit(header.n_slots) || header.n_slots > file->size) {
+        throw invalid("truncated snapshot");
+    }
+
+    // section offsets relative to the end of the header
+    const auto n = header.n_vertices;
+    const auto m = header.n_edges;
+    const auto slots_at = padded(n * sizeof(Vertex));
+    const auto offsets_at = slots_at + padded(header.n_slots * sizeof(uint32_t));
+    const auto targets_at = offsets_at + padded((n + 1) * sizeof(uint32_t));
+    const auto latencies_at = targets_at + padded(m * sizeof(uint32_t));
+    const auto name_offsets_at = latencies_at + padded(m * sizeof(int));
+    const auto name_bytes_at = name_offsets_at + padded(header.n_names > 0 ? (header.n_names + 1) * sizeof(uint64_t) : 0);
+    const auto body_size = name_bytes_at + padded(header.names_bytes);
+    if (header.n_names > file->size || header.names_bytes > file->size || file->size - sizeof(header) != body_size) {
+        throw invalid("truncated snapshot");
+    }
+    const auto* const body = file->data + sizeof(header);
+    if (verify && snapshot_checksum(0, body, body_size) != header.checksum) {
+        throw invalid("checksum mismatch");
+    }
+
+    Graph g{};
+    g.storage = make_shared<Storage>();
+    g.storage->mapping = file;
+    g.vertex_names = span{reinterpret_cast<const Vertex*>(body), n};
+    g.id_slots = span{reinterpret_cast<const uint32_t*>(body + slots_at), header.n_slots};
+    g.offsets = span{reinterpret_cast<const uint32_t*>(body + offsets_at), n + 1};
+    g.targets = span{reinterpret_cast<const uint32_t*>(body + targets_at), m};
+    g.latencies = span{reinterpret_cast<const int*>(body + latencies_at), m};
+    if (g.offsets.front() != 0 || g.offsets.back() != m || !ranges::is_sorted(g.offsets)) {
+        throw invalid("corrupt adjacency");
+    }
+    if (verify && (ranges::any_of(g.targets, [n](uint32_t v) { return v >= n; }) ||
+                   ranges::any_of(g.id_slots, [n](uint32_t slot) { return slot > n; }) ||
+                   ranges::count(g.id_slots, 0) < static_cast<ptrdiff_t>(header.n_slots - n))) {
+        throw invalid("corrupt adjacency");
+    }
+
+    if (names != nullptr && header.n_names > 0) {
+        // the graph's ServiceIds index the snapshot's table, so the names
+        // have to get the same ids here
+        if (names->size() != 0) {
+            throw invalid("name table to load into is not empty");
+        }
+        const auto* const name_offsets = reinterpret_cast<const uint64_t*>(body + name_offsets_at);
+        const auto name_bytes = string_view{body + name_bytes_at, header.names_bytes};
+        for (uint64_t i = 0; i < header.n_names; i++) {
+            if (name_offsets[i] > name_offsets[i + 1] || name_offsets[i + 1] > name_bytes.size()) {
+                throw invalid("corrupt name table");
+            }
+            if (names->intern(name_bytes.substr(name_offsets[i], name_offsets[i + 1] - name_offsets[i])).value != i) {
+                throw invalid("duplicate name in name table");
+            }
         }
     }
+    return g;
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+typename Graph<EdgeIterator, VertexIterator, Vertex>::AllPairs
+Graph<EdgeIterator, VertexIterator, Vertex>::all_pairs(const bool with_next_hops, AllPairsMethod method,
+                                                       const ParallelOptions& options) const {
+    AllPairs ret{*this};
+    if (method == AllPairsMethod::automatic) {
+        // Floyd-Warshall costs n^3 over the vector width, Dijkstra about
+        // n m log n; the blocked matrix also has to fit into memory comfortably
+        const auto n = static_cast<double>(vertex_names.size());
+        const auto m = static_cast<double>(targets.size());
+        method = n <= 4096 && n * n <= 8 * m * log2(n + 1) ? AllPairsMethod::floyd_warshall : AllPairsMethod::dijkstra;
+    }
+    if (method == AllPairsMethod::floyd_warshall) {
+        ret.floyd_warshall(with_next_hops);
+    } else {
+        ret.dijkstra(with_next_hops, options.pool != nullptr ? options.pool : &default_pool());
+    }
     return ret;
 }
 
+// One k-block step of blocked Floyd-Warshall on a padded matrix with row
+// length width: relaxes every cell of block (ib, jb) through every k of block
+// kb. The loop over j is branch-free, so it vectorizes, next hops included.
+template <bool WithNextHops>
+static void relax_block(int* dist, uint32_t* next_hop, const size_t width, const size_t block, const size_t ib,
+                        const size_t jb, const size_t kb) {
+    for (auto k = kb * block; k < (kb + 1) * block; k++) {
+        const auto* const dist_k = dist + k * width;
+        for (auto i = ib * block; i < (ib + 1) * block; i++) {
+            auto* const dist_i = dist + i * width;
+            const auto dist_ik = dist_i[k];
+            const auto next_ik = WithNextHops ? next_hop[i * width + k] : 0;
+            for (auto j = jb * block; j < (jb + 1) * block; j++) {
+                const auto via = dist_ik + dist_k[j];
+                const auto better = via < dist_i[j];
+                dist_i[j] = better ? via : dist_i[j];
+                if constexpr (WithNextHops) {
+                    next_hop[i * width + j] = better ? next_ik : next_hop[i * width + j];
+                }
+            }
+        }
+    }
+}
+
+template <bool WithNextHops>
+static void blocked_floyd_warshall(int* dist, uint32_t* next_hop, const size_t width, const size_t block) {
+    // the diagonal block first, then its row and column, then the rest, so
+    // that every block only reads blocks already final for this kb
+    const auto n_blocks = width / block;
+    for (size_t kb = 0; kb < n_blocks; kb++) {
+        relax_block<WithNextHops>(dist, next_hop, width, block, kb, kb, kb);
+        for (size_t b = 0; b < n_blocks; b++) {
+            if (b != kb) {
+                relax_block<WithNextHops>(dist, next_hop, width, block, kb, b, kb);
+                relax_block<WithNextHops>(dist, next_hop, width, block, b, kb, kb);
+            }
+        }
+        for (size_t ib = 0; ib < n_blocks; ib++) {
+            for (size_t jb = 0; jb < n_blocks; jb++) {
+                if (ib != kb && jb != kb) {
+                    relax_block<WithNextHops>(dist, next_hop, width, block, ib, jb, kb);
+                }
+            }
+        }
+    }
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+void Graph<EdgeIterator, VertexIterator, Vertex>::AllPairs::floyd_warshall(const bool with_next_hops) {
+    // a 64 by 64 block of ints is 16 KiB and stays in L1; unreachable is half
+    // of the int range so that adding two of them cannot overflow
+    constexpr size_t block = 64;
+    constexpr int unreachable = numeric_limits<int>::max() / 2;
+    const auto width = max(block, (n + block - 1) / block * block);
+    vector<int> padded(width * width, unreachable);
+    vector<uint32_t> padded_next(with_next_hops ? width * width : 0, 0);
+    for (uint32_t u = 0; u < n; u++) {
+        for (auto i = graph.offsets[u]; i < graph.offsets[u + 1]; i++) {
+            padded[u * width + graph.targets[i]] = min(graph.latencies[i], unreachable);
+            if (with_next_hops) {
+                padded_next[u * width + graph.targets[i]] = graph.targets[i];
+            }
+        }
+    }
+    if (with_next_hops) {
+        blocked_floyd_warshall<true>(padded.data(), padded_next.data(), width, block);
+    } else {
+        blocked_floyd_warshall<false>(padded.data(), nullptr, width, block);
+    }
+
+    dist.resize(n * n);
+    next_hop.resize(with_next_hops ? n * n : 0);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            const auto d = padded[i * width + j];
+            dist[i * n + j] = d >= unreachable ? numeric_limits<int>::max() : d;
+            if (with_next_hops) {
+                next_hop[i * n + j] = padded_next[i * width + j];
+            }
+        }
+    }
+}
+
 template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
-vector<Vertex> Graph<EdgeIterator, VertexIterator, Vertex>::vertices() const {
-    unordered_set<Vertex> m{};
-    ranges::transform(graph, inserter(m, begin(m)), [](const auto &p) { return p.first.first; });
-    ranges::transform(graph, inserter(m, begin(m)), [](const auto &p) { return p.first.second; });
-    vector<Vertex> ret{};
-    ranges::copy(m, back_inserter(ret));
+void Graph<EdgeIterator, VertexIterator, Vertex>::AllPairs::dijkstra(const bool with_next_hops, WorkStealingPool* pool) {
+    dist.resize(n * n);
+    next_hop.resize(with_next_hops ? n * n : 0);
+    parallel_for(pool, n, [&](const size_t begin, const size_t end) {
+        vector<int> source_dist{};
+        vector<uint32_t> parent{};
+        vector<uint32_t> chain{};
+        for (auto source = static_cast<uint32_t>(begin); source < end; source++) {
+            graph.shortest_paths(source, numeric_limits<uint32_t>::max(), source_dist, parent);
+            ranges::copy(source_dist, dist.begin() + source * n);
+            if (!with_next_hops) {
+                continue;
+            }
+            // the next hop towards v is the one towards its parent, except for
+            // the vertices right after the source; memoized along the chains
+            auto* const first = next_hop.data() + source * n;
+            constexpr auto unknown = numeric_limits<uint32_t>::max();
+            ranges::fill(first, first + n, unknown);
+            for (uint32_t v = 0; v < n; v++) {
+                if (source_dist[v] == numeric_limits<int>::max()) {
+                    continue;
+                }
+                auto u = v;
+                while (first[u] == unknown && parent[u] != source) {
+                    chain.push_back(u);
+                    u = parent[u];
+                }
+                const auto hop = first[u] != unknown ? first[u] : u;
+                first[u] = hop;
+                for (const auto w : chain) {
+                    first[w] = hop;
+                }
+                chain.clear();
+            }
+        }
+    });
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<int> Graph<EdgeIterator, VertexIterator, Vertex>::AllPairs::latency(const Vertex& start_node, const Vertex& end_node) const {
+    const auto start_id = graph.vertex_id(start_node);
+    const auto end_id = graph.vertex_id(end_node);
+    if (!start_id || !end_id || dist[*start_id * n + *end_id] == numeric_limits<int>::max()) {
+        return nullopt;
+    }
+    return dist[*start_id * n + *end_id];
+}
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+optional<vector<Vertex>> Graph<EdgeIterator, VertexIterator, Vertex>::AllPairs::trace(const Vertex& start_node,
+                                                                                       const Vertex& end_node) const {
+    if (next_hop.empty() || !latency(start_node, end_node)) {
+        return nullopt;
+    }
+    const auto end_id = *graph.vertex_id(end_node);
+    vector<Vertex> ret{start_node};
+    auto v = *graph.vertex_id(start_node);
+    do {
+        v = next_hop[v * n + end_id];
+        ret.emplace_back(graph.vertex_names[v]);
+    } while (v != end_id);
     return ret;
 }
 
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+span<const Vertex> Graph<EdgeIterator, VertexIterator, Vertex>::vertices() const {
+    return vertex_names;
+}
+
 class A
 {
     struct Rslt {
@@ -175,4 +2525,25 @@ namespace std {
     };
 }
 
+template class GraphBuilder<char>;
+template class GraphBuilder<int>;
+template class GraphBuilder<ServiceId>;
 template class Graph<vector<pair<pair<char, char>, int>>::const_iterator, vector<char>::const_iterator, char>;
+template class Graph<vector<pair<pair<int, int>, int>>::const_iterator, vector<int>::const_iterator, int>;
+template class Graph<vector<pair<pair<ServiceId, ServiceId>, int>>::const_iterator, vector<ServiceId>::const_iterator, ServiceId>;
+
+// the instrumented queries, which take NoStats implicitly
+template optional<int> CharGraph::average_latency<QueryStats>(const vector<char>::const_iterator&,
+                                                              const vector<char>::const_iterator&, QueryStats&) const;
+template vector<vector<char>> CharGraph::traces<QueryStats>(char, char, int, int, int, QueryStats&) const;
+template optional<int>
+Graph<vector<pair<pair<int, int>, int>>::const_iterator, vector<int>::const_iterator, int>::average_latency<QueryStats>(
+    const vector<int>::const_iterator&, const vector<int>::const_iterator&, QueryStats&) const;
+template vector<vector<int>>
+Graph<vector<pair<pair<int, int>, int>>::const_iterator, vector<int>::const_iterator, int>::traces<QueryStats>(
+    int, int, int, int, int, QueryStats&) const;
+template optional<int> ServiceGraph::average_latency<QueryStats>(const vector<ServiceId>::const_iterator&,
+                                                                 const vector<ServiceId>::const_iterator&,
+                                                                 QueryStats&) const;
+template vector<vector<ServiceId>> ServiceGraph::traces<QueryStats>(ServiceId, ServiceId, int, int, int,
+                                                                    QueryStats&) const;
@@ -8,6 +8,20 @@
 #include <unordered_map>
 #include <limits>
 #include <compare>
+#include <memory>
+#include <type_traits>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stop_token>
+
+#include "work_stealing_pool.hpp"
+#include <cstdint>
+#include <span>
+#include <iterator>
 
 using namespace std;
 
@@ -27,23 +41,640 @@ struct pair_hash {
     }
 };
 
+// How Graph::all_pairs() computes its matrix: Floyd-Warshall suits small
+// dense graphs, one Dijkstra per source large sparse ones.
+enum class AllPairsMethod { automatic, floyd_warshall, dijkstra };
+
+// How a parallel query is run. A null pool means default_pool().
+struct ParallelOptions {
+    WorkStealingPool* pool = nullptr;
+    // traces() hands out one subtree per path of this many hops
+    int split_hops = 2;
+    // return traces in the order of lazy_traces() instead of the order in
+    // which the workers happen to finish them
+    bool deterministic_order = true;
+};
+
+// Limits on the work of one traces() query. The deadline and the stop token
+// are checked every 1024 expanded paths and at every hop.
+struct QueryBudget {
+    size_t max_results = numeric_limits<size_t>::max();
+    // paths extended by an edge, which is also the number of paths held
+    uint64_t max_expanded = numeric_limits<uint64_t>::max();
+    optional<chrono::steady_clock::time_point> deadline{};
+    stop_token stop{};
+};
+
+// Why a query returned fewer results than it would have without its budget.
+enum class Truncation { none, max_results, max_expanded, deadline, cancelled };
+
+// The distribution of the latency of a trace, as probabilities of buckets of
+// a fixed width, where every latency of a bucket is taken to be its lower
+// bound. A trace's latency lies below its bucket's lower bound plus one bucket
+// width per edge.
+struct LatencyDistribution {
+    int bucket_width = 1;
+    // probabilities[i] is the probability of bucket first_bucket + i
+    int first_bucket = 0;
+    vector<double> probabilities{};
+    // what every bucket is shifted by beyond its lower bound, in [0,
+    // bucket_width): the part of the certain latencies of a path that does
+    // not add up to whole buckets
+    int offset = 0;
+
+    // The lowest bucket lower bound up to which the probability is at least
+    // p. Throws invalid_argument unless p is in (0, 1].
+    [[nodiscard]] int percentile(double p) const;
+    [[nodiscard]] double mean() const;
+};
+
+// Latency counts in buckets of a fixed width: bucket b holds the latencies in
+// [b * width, (b + 1) * width). Histograms of the same width merge by adding
+// their counts, so per-process histograms can be combined.
+class LatencyHistogram {
+public:
+    explicit LatencyHistogram(int bucket_width = 1);
+
+    // negative latencies count towards bucket 0
+    void add(int latency, uint64_t count = 1);
+    // Throws invalid_argument for a different bucket width.
+    void merge(const LatencyHistogram& other);
+
+    [[nodiscard]] int bucket_width() const { return width; }
+    // counts()[i] is the count of bucket first_bucket() + i
+    [[nodiscard]] int first_bucket() const { return first; }
+    [[nodiscard]] span<const uint64_t> counts() const { return counts_; }
+    [[nodiscard]] uint64_t total() const { return total_; }
+    [[nodiscard]] bool empty() const { return total_ == 0; }
+    // the counts divided by the total
+    [[nodiscard]] LatencyDistribution distribution() const;
+
+private:
+    int width;
+    int first = 0;
+    vector<uint64_t> counts_{};
+    uint64_t total_ = 0;
+};
+
+// The phases whose wall time QueryStats records: looking up the query's
+// vertices, computing the bounds a bounded search prunes with, the search.
+enum class QueryPhase { lookup, bounds, search };
+inline constexpr size_t n_query_phases = 3;
+
+// The statistics policy of the instrumented queries when nothing is recorded:
+// every call is empty and inlined away, so the query costs what it would
+// without instrumentation.
+struct NoStats {
+    static constexpr bool enabled = false;
+
+    void enter(QueryPhase) {}
+    void expanded(size_t, uint64_t) {}
+    void frontier(uint64_t) {}
+    void pruned_by_latency() {}
+    void pruned_by_missing_edge() {}
+    void probes(uint64_t) {}
+    void allocation() {}
+    void finish() {}
+};
+
+// What one instrumented query did; finish() also adds it to
+// query_stats_totals(). A path is pruned by a missing edge when it cannot be
+// extended: in traces() its last vertex has no out-edges, in
+// average_latency() the next edge of the trace does not exist.
+struct QueryStats {
+    static constexpr bool enabled = true;
+
+    // paths extended in each hop of the search
+    vector<uint64_t> expanded_per_hop{};
+    uint64_t peak_frontier = 0;
+    uint64_t n_pruned_by_latency = 0;
+    uint64_t n_pruned_by_missing_edge = 0;
+    // slots of the vertex index looked at
+    uint64_t hash_probes = 0;
+    // growths of the search's buffers and the traces returned
+    uint64_t allocations = 0;
+    array<chrono::nanoseconds, n_query_phases> phase_time{};
+
+    // ends the current phase, if any, and starts the given one
+    void enter(QueryPhase phase);
+    void expanded(size_t hop, uint64_t n);
+    void frontier(uint64_t size) { peak_frontier = max(peak_frontier, size); }
+    void pruned_by_latency() { n_pruned_by_latency++; }
+    void pruned_by_missing_edge() { n_pruned_by_missing_edge++; }
+    void probes(uint64_t n) { hash_probes += n; }
+    void allocation() { allocations++; }
+    // ends the current phase and publishes the statistics
+    void finish();
+
+private:
+    optional<QueryPhase> phase{};
+    chrono::steady_clock::time_point phase_start{};
+};
+
+// The statistics of all finished instrumented queries of the process, to be
+// read while queries run.
+struct QueryStatsTotals {
+    atomic<uint64_t> queries{0};
+    atomic<uint64_t> expanded{0};
+    // the largest frontier of any query
+    atomic<uint64_t> peak_frontier{0};
+    atomic<uint64_t> pruned_by_latency{0};
+    atomic<uint64_t> pruned_by_missing_edge{0};
+    atomic<uint64_t> hash_probes{0};
+    atomic<uint64_t> allocations{0};
+    array<atomic<uint64_t>, n_query_phases> phase_nanoseconds{};
+};
+
+QueryStatsTotals& query_stats_totals();
+
+template <class Stats>
+concept stats_policy = requires(Stats& stats) {
+    { Stats::enabled } -> convertible_to<bool>;
+    stats.finish();
+};
+
+// A service interned by ServiceNames, so that graph algorithms run on dense
+// integers instead of names.
+struct ServiceId {
+    uint32_t value = 0;
+
+    friend auto operator<=>(const ServiceId&, const ServiceId&) = default;
+};
+
+template <>
+struct std::hash<ServiceId> {
+    size_t operator()(const ServiceId id) const noexcept { return id.value; }
+};
+
+// Interns service names into dense ServiceIds, numbered in order of first
+// appearance, and maps ids back to names for output.
+class ServiceNames {
+public:
+    ServiceId intern(string_view name);
+    [[nodiscard]] optional<ServiceId> find(string_view name) const;
+    // valid as long as the table
+    [[nodiscard]] string_view name(ServiceId id) const { return *names[id.value]; }
+    [[nodiscard]] vector<string_view> names_of(span<const ServiceId> ids) const;
+    [[nodiscard]] size_t size() const { return names.size(); }
+
+private:
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(string_view name) const noexcept { return hash<string_view>{}(name); }
+    };
+
+    // the keys of the map are stable, so names can point into it
+    unordered_map<string, uint32_t, NameHash, equal_to<>> ids{};
+    vector<const string*> names{};
+};
+
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+class Graph;
+
+// Collects the edges of a Graph one at a time, interning their vertices into
+// dense ids as they arrive.
+template <regular Vertex>
+class GraphBuilder {
+public:
+    void reserve(size_t n_edges);
+    void add_edge(const Vertex& source, const Vertex& target, int latency);
+
+private:
+    template <input_iterator EdgeIterator, input_iterator VertexIterator, regular V>
+    friend class Graph;
+
+    vector<Vertex> vertex_names{};
+    unordered_map<Vertex, uint32_t> vertex_ids{};
+    vector<tuple<uint32_t, uint32_t, int>> edges{};
+
+    uint32_t intern(const Vertex& v);
+};
+
 template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
 class Graph {
 public:
 
   explicit Graph<EdgeIterator, VertexIterator, Vertex>(const EdgeIterator& ei_begin, const EdgeIterator& ei_end);
+  explicit Graph(GraphBuilder<Vertex> builder);
 
-    [[nodiscard]] optional<int> average_latency(VertexIterator& trace_begin, VertexIterator& trace_end) const;
     [[nodiscard]] optional<int> average_latency(const VertexIterator& trace_begin, const VertexIterator& trace_end) const;
+    // average_latency() recording into stats, which is NoStats or QueryStats.
+    template <stats_policy Stats>
+    [[nodiscard]] optional<int> average_latency(const VertexIterator& trace_begin, const VertexIterator& trace_end,
+                                                Stats& stats) const;
+    // average_latency() of a batch of traces stored back to back: trace i is
+    // vertices[trace_offsets[i]] .. vertices[trace_offsets[i + 1] - 1] and its
+    // latency is written to out[i]. The traces are scored in parallel on the
+    // pool, without allocating per trace.
+    void average_latencies(span<const Vertex> vertices, span<const size_t> trace_offsets, span<optional<int>> out,
+                           const ParallelOptions& options = {}) const;
 
   [[nodiscard]] vector<vector<Vertex>> traces(Vertex start_node, Vertex end_node, int min_hops,
                               int max_hops,
                               int max_latency = numeric_limits<int>::max()) const;
+  // traces() recording into stats, which is NoStats or QueryStats.
+  template <stats_policy Stats>
+  [[nodiscard]] vector<vector<Vertex>> traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops,
+                                              int max_latency, Stats& stats) const;
+
+  struct TraceResult {
+      vector<vector<Vertex>> traces;
+      Truncation truncation = Truncation::none;
+  };
+  // traces() stopping once the budget is used up. The traces found until then
+  // come back with the reason; they are all of the traces of fewer hops than
+  // the last one, and some of the last.
+  [[nodiscard]] TraceResult traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops, int max_latency,
+                                   const QueryBudget& budget) const;
+
+  // traces() with the search split into the subtrees below the paths of
+  // options.split_hops hops, which the pool searches in parallel. The traces
+  // come in the order of lazy_traces() when options.deterministic_order is set.
+  [[nodiscard]] vector<vector<Vertex>> traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops,
+                                              int max_latency, const ParallelOptions& options) const;
+
+  class TraceView;
+
+  // The traces traces() would return, produced one at a time by a depth-first
+  // search that keeps only the current path, so memory use is proportional to
+  // the hop count instead of the number of results. The traces come in
+  // depth-first rather than hop order, and each span is only valid until the
+  // view is advanced. The view must not outlive the graph.
+  [[nodiscard]] TraceView lazy_traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops,
+                                      int max_latency = numeric_limits<int>::max()) const;
+
+  // The number of traces traces() would return for the same arguments,
+  // computed by dynamic programming instead of enumerating them: over
+  // (vertex, hops) without a latency bound and over (vertex, remaining
+  // latency budget) with one. Latencies are assumed to be non-negative.
+  // Throws overflow_error if the count does not fit into 64 bits, which
+  // includes an infinite count: max_hops of numeric_limits<int>::max() with
+  // a zero-latency cycle on a trace within the budget.
+  [[nodiscard]] uint64_t count_traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops,
+                                      int max_latency = numeric_limits<int>::max()) const;
+  // count_traces() with every dynamic programming step split across the pool.
+  [[nodiscard]] uint64_t count_traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops, int max_latency,
+                                      const ParallelOptions& options) const;
+  // count_traces() without a latency bound by raising the adjacency matrix to
+  // powers by repeated squaring, in O(n^3 log max_hops) instead of
+  // O(max_hops m). count_traces() switches to it for hop bounds that are
+  // large for the size of the graph. Throws overflow_error like it.
+  [[nodiscard]] uint64_t count_traces_by_matrix_power(Vertex start_node, Vertex end_node, int min_hops, int max_hops,
+                                                      const ParallelOptions& options = {}) const;
+
+  // The arguments of one traces() or count_traces() query of a batch.
+  struct TraceQuery {
+      Vertex start_node;
+      Vertex end_node;
+      int min_hops;
+      int max_hops;
+      int max_latency = numeric_limits<int>::max();
+  };
+  // traces() for every query of a batch. The queries with the same start
+  // share one breadth-first search, 64 at a time, whose paths carry a bitset
+  // of the queries that can still use them: a query drops out of a path once
+  // its end_node is too many hops or too much latency away. The groups of
+  // queries are searched in parallel on the pool.
+  [[nodiscard]] vector<vector<vector<Vertex>>> traces(span<const TraceQuery> queries,
+                                                      const ParallelOptions& options = {}) const;
+  // count_traces() for every query of a batch. The queries without a latency
+  // bound share one pass of the hop dynamic program for up to 64 starts at a
+  // time, with a lane per start and a bitset per vertex of the lanes that
+  // reached it, so every hop scans the in-edges once for all of them. The
+  // other queries are counted one by one. Throws overflow_error if a count
+  // does not fit into 64 bits.
+  [[nodiscard]] vector<uint64_t> count_traces(span<const TraceQuery> queries, const ParallelOptions& options = {}) const;
+
+  // The lowest-latency trace of at least one hop from start_node to end_node,
+  // so a start_node equal to end_node yields the shortest cycle through it.
+  // Latencies are assumed to be non-negative.
+  [[nodiscard]] optional<pair<vector<Vertex>, int>> shortest_trace(Vertex start_node, Vertex end_node) const;
+  [[nodiscard]] optional<int> shortest_latency(Vertex start_node, Vertex end_node) const;
+  // The k lowest-latency traces from start_node to end_node in order of
+  // latency, with the semantics of shortest_trace(). Simple traces visit no
+  // vertex twice, except for start_node ending a cycle, and are found by Yen's
+  // algorithm in at most k times the trace length restricted searches. Other
+  // traces are found by one search that settles every vertex up to k times.
+  // Both are A* searches guided by the latencies to end_node, so their cost
+  // does not depend on the number of all traces.
+  [[nodiscard]] vector<pair<vector<Vertex>, int>> k_shortest_traces(Vertex start_node, Vertex end_node, size_t k,
+                                                                    bool simple_only = true) const;
+
+  // Writes the graph as a versioned binary snapshot: a header, the vertex
+  // table, the CSR arrays, the service names if given, and a checksum. The
+  // snapshot goes to a temporary file in the same directory that is renamed
+  // over path, so path always holds a complete snapshot and graphs loaded
+  // from the old one keep their mapping.
+  void write_snapshot(const string& path, const ServiceNames* names = nullptr) const
+    requires is_trivially_copyable_v<Vertex>;
+  // A read-only graph over a memory-mapped snapshot, using the mapped vertex
+  // table, vertex id index and CSR arrays in place. The id index is a hash
+  // table, so the snapshot must have been written by a build with the same
+  // std::hash of Vertex and the same probing. Fills names if the snapshot
+  // has them and names is given, which must then be empty. Throws
+  // runtime_error for a file that is not a valid snapshot, checking the
+  // checksum if verify is set, or for names that is not empty.
+  [[nodiscard]] static Graph load_snapshot(const string& path, ServiceNames* names = nullptr, bool verify = true)
+    requires is_trivially_copyable_v<Vertex>;
+
+  // A change to one edge: set its latency, adding the edge and any new
+  // vertices if needed, or remove it if latency is empty.
+  struct EdgeUpdate {
+      Vertex source;
+      Vertex target;
+      optional<int> latency;
+  };
+
+  // Applies updates in order. Latency changes of existing edges are written
+  // in place; if any edge is added or removed, the adjacency is rebuilt once
+  // for the whole batch, keeping the relative order of the vertex ids and
+  // dropping vertices left without edges. The generation goes up by one if
+  // anything changed. Invalidates views from vertices() and lazy_traces().
+  void apply_updates(span<const EdgeUpdate> updates);
+  void upsert_edge(const Vertex& source, const Vertex& target, int latency);
+  // false if there was no such edge
+  bool remove_edge(const Vertex& source, const Vertex& target);
+  // Counts the modifications of this graph, so that caches of derived results
+  // can tell that they are stale. Copies start with the generation of their
+  // original.
+  [[nodiscard]] uint64_t generation() const { return generation_; }
+  // Identifies the contents of this graph among all graphs of its type: it
+  // changes with every modification and is shared by copies until one of them
+  // is modified. Later contents have higher versions, whether modified or
+  // built anew, so caches can tell stale results from current ones even
+  // across graphs that replace each other.
+  [[nodiscard]] uint64_t version() const { return storage->version; }
+
+  // Gives the edge from source to target a latency histogram, replacing its
+  // single latency in latency_distribution(), or with an empty histogram
+  // takes it away; false if there is no such edge. All histograms of a graph
+  // have the same bucket width, otherwise this throws invalid_argument; the
+  // width is free again once no edge has a histogram. A
+  // later latency change of the edge drops its histogram, and snapshots do not
+  // hold histograms.
+  bool set_latency_histogram(const Vertex& source, const Vertex& target, const LatencyHistogram& histogram);
+
+  // The latency distribution of a trace, as the convolution of the histograms
+  // of its edges, which are taken to be independent; an edge without one has
+  // its latency for certain. Empty for the traces average_latency() has no
+  // latency for.
+  [[nodiscard]] optional<LatencyDistribution> latency_distribution(const VertexIterator& trace_begin,
+                                                                   const VertexIterator& trace_end) const;
+  // The percentile p of the latency_distribution() of a batch of traces laid
+  // out as for average_latencies(), scored in parallel with scratch buffers
+  // reused across the traces of a chunk.
+  void latency_percentiles(span<const Vertex> vertices, span<const size_t> trace_offsets, double p,
+                           span<optional<int>> out, const ParallelOptions& options = {}) const;
+
+  class AllPairs;
+
+  // The shortest-latency matrix over all pairs of vertices, with the same
+  // at-least-one-hop semantics as shortest_trace(). Floyd-Warshall runs in
+  // cache-sized blocks with vectorizable inner loops; Dijkstra runs one search
+  // per source on the pool. With next hops the traces can be rebuilt too.
+  // Path latencies are assumed to stay below 2^30.
+  [[nodiscard]] AllPairs all_pairs(bool with_next_hops = false, AllPairsMethod method = AllPairsMethod::automatic,
+                                   const ParallelOptions& options = {}) const;
+
+  // The distinct vertices in dense id order. The view stays valid until the
+  // graph is modified or destroyed.
+  [[nodiscard]] span<const Vertex> vertices() const;
+private:
+    // The arrays behind a graph: either owned here, or left empty when the
+    // graph is a view of a memory-mapped snapshot that mapping keeps alive.
+    // Copies of a graph share them.
+    struct Storage {
+        vector<Vertex> vertex_names{};
+        vector<uint32_t> id_slots{0, 0};
+        vector<uint32_t> offsets{0};
+        vector<uint32_t> targets{};
+        vector<int> latencies{};
+        shared_ptr<const void> mapping{};
+        // the normalized histograms per edge like latencies, without
+        // probabilities for the edges that have none; empty if no edge has one
+        vector<LatencyDistribution> distributions{};
+        // the bucket width of the histograms, and how many edges have one
+        int histogram_width = 0;
+        size_t n_distributions = 0;
+        uint64_t version = next_version();
+    };
+    shared_ptr<Storage> storage = make_shared<Storage>();
+
+    span<const Vertex> vertex_names{};
+    // Open-addressing index from vertex to dense id: linear probing from the
+    // slot picked by the high bits of the mixed hash, where a slot holds an
+    // id plus one or zero if free. Flat arrays, so a snapshot can hold it.
+    span<const uint32_t> id_slots{storage->id_slots};
+    // Compressed sparse row adjacency over dense vertex ids: the out-edges of
+    // vertex u are targets[offsets[u]] .. targets[offsets[u + 1] - 1], and
+    // latencies holds the latency of each of those edges at the same index.
+    span<const uint32_t> offsets{storage->offsets};
+    span<const uint32_t> targets{};
+    span<const int> latencies{};
+
+    uint64_t generation_ = 0;
+
+    static uint64_t next_version();
+
+    Graph() = default;
+    // points the spans at the owned arrays of storage
+    void bind_storage();
+    // gives this graph arrays of its own to modify, copying them if they are
+    // mapped or shared with a copy of the graph
+    void make_writable();
+    [[nodiscard]] optional<uint32_t> edge_index(uint32_t source, uint32_t target) const;
+    // fills the owned id_slots for the owned vertex table
+    void build_id_index();
+
+    static GraphBuilder<Vertex> collect(const EdgeIterator& ei_begin, const EdgeIterator& ei_end);
+    // the breadth-first search behind traces()
+    template <stats_policy Stats>
+    [[nodiscard]] TraceResult search_traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops,
+                                            int max_latency, const QueryBudget& budget, Stats& stats) const;
+    [[nodiscard]] optional<uint32_t> vertex_id(const Vertex& v) const;
+    template <stats_policy Stats>
+    [[nodiscard]] optional<uint32_t> vertex_id(const Vertex& v, Stats& stats) const;
+    [[nodiscard]] optional<int> edge_latency(uint32_t source, uint32_t target) const;
+    // the latency of a path of vertex ids, where an unknown vertex has an id
+    // of numeric_limits<uint32_t>::max()
+    [[nodiscard]] optional<int> path_latency(span<const uint32_t> ids) const;
+    struct ConvolutionScratch;
+    // the latency distribution of a path of vertex ids into scratch.result,
+    // false as for path_latency()
+    bool path_distribution(span<const uint32_t> ids, ConvolutionScratch& scratch) const;
+    // takes the histogram of edge i away, if it has one; storage must be
+    // writable
+    void drop_distribution(size_t i);
+    // the transposed adjacency: the in-edges of v come from
+    // sources[offsets[v]] .. sources[offsets[v + 1] - 1]
+    struct InEdges {
+        vector<uint32_t> offsets;
+        vector<uint32_t> sources;
+        vector<int> latencies;
+    };
+    [[nodiscard]] InEdges in_edges() const;
+
+    // the counting dynamic programs pull along in-edges, so that every vertex
+    // of a step can be computed independently on the pool (or inline if null)
+    [[nodiscard]] uint64_t count_traces(Vertex start_node, Vertex end_node, int min_hops, int max_hops, int max_latency,
+                                        WorkStealingPool* pool) const;
+    [[nodiscard]] uint64_t count_by_hops(const InEdges& in, uint32_t source, uint32_t target, int min_hops, int max_hops,
+                                         WorkStealingPool* pool) const;
+    [[nodiscard]] uint64_t count_by_budget(const InEdges& in, uint32_t source, uint32_t target, int max_latency,
+                                           WorkStealingPool* pool) const;
+    [[nodiscard]] uint64_t count_by_hops_and_budget(const InEdges& in, uint32_t source, uint32_t target, int min_hops,
+                                                    int max_hops, int max_latency, WorkStealingPool* pool) const;
+    [[nodiscard]] uint64_t count_by_matrix_power(uint32_t source, uint32_t target, int min_hops, int max_hops,
+                                                 WorkStealingPool* pool) const;
+    // whether count_traces() without a latency bound squares matrices
+    [[nodiscard]] bool counts_by_matrix_power(int max_hops) const;
+    // count_by_hops() for the queries of a batch in ret that have starts
+    // sources[lane] and end_ids; it adds to ret
+    void count_by_hops(const InEdges& in, span<const uint32_t> sources, span<const TraceQuery> queries,
+                       span<const size_t> lanes, span<const uint32_t> end_ids, span<uint64_t> ret,
+                       WorkStealingPool* pool) const;
+    // the fewest hops of a trace of any number of hops from every vertex to
+    // target (numeric_limits<int>::max() if there is none)
+    [[nodiscard]] vector<int> hops_to(const InEdges& in, uint32_t target) const;
+    // the lowest latency of a trace of any number of hops from every vertex to
+    // target, by Dijkstra along in-edges that stops beyond max_latency
+    // (numeric_limits<int>::max() for those vertices); a bounded search drops
+    // every edge this shows cannot make it
+    [[nodiscard]] vector<int> latencies_to(uint32_t target, int max_latency) const;
+    // Dijkstra over traces of at least one hop from source, stopping once
+    // target is settled: dist[v] is the lowest latency of such a trace ending
+    // in v (numeric_limits<int>::max() if there is none) and parent[v] the
+    // vertex before v on it.
+    void shortest_paths(uint32_t source, uint32_t target, vector<int>& dist, vector<uint32_t>& parent) const;
+    struct SpurSearch;
+    // shortest_paths() for a spur of Yen's algorithm: the trace may not enter
+    // a vertex blocked in search other than target, nor take an edge from
+    // source to one of cut_targets, and gets no slower than max_latency. Its
+    // vertices go to path, source first.
+    [[nodiscard]] optional<int> spur_path(uint32_t source, uint32_t target, span<const uint32_t> cut_targets,
+                                          int max_latency, SpurSearch& search, vector<uint32_t>& path) const;
+    [[nodiscard]] vector<pair<vector<uint32_t>, int>> k_shortest_simple(uint32_t source, uint32_t target, size_t k) const;
+    [[nodiscard]] vector<pair<vector<uint32_t>, int>> k_shortest_walks(uint32_t source, uint32_t target, size_t k) const;
+};
+
+// Precomputed shortest latencies between all pairs of vertices of a graph. It
+// keeps a copy of the graph as it was, which shares the graph's arrays.
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+class Graph<EdgeIterator, VertexIterator, Vertex>::AllPairs {
+public:
+    // shortest_latency() in O(1) without allocating
+    [[nodiscard]] optional<int> latency(const Vertex& start_node, const Vertex& end_node) const;
+    // shortest_trace(), if computed with next hops
+    [[nodiscard]] optional<vector<Vertex>> trace(const Vertex& start_node, const Vertex& end_node) const;
+
+private:
+    friend class Graph;
+
+    explicit AllPairs(const Graph& graph) : graph{graph}, n{graph.vertex_names.size()} {}
+
+    Graph graph;
+    size_t n;
+    // row-major n by n; numeric_limits<int>::max() where there is no trace
+    vector<int> dist{};
+    // the vertex after the start on a shortest trace, if requested
+    vector<uint32_t> next_hop{};
+
+    void floyd_warshall(bool with_next_hops);
+    void dijkstra(bool with_next_hops, WorkStealingPool* pool);
+};
+
+// An input range over the traces of Graph::lazy_traces().
+template <input_iterator EdgeIterator, input_iterator VertexIterator, regular Vertex>
+class Graph<EdgeIterator, VertexIterator, Vertex>::TraceView {
+public:
+    class iterator {
+    public:
+        using value_type = span<const Vertex>;
+        using difference_type = ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(TraceView* view) : view{view} {}
+
+        value_type operator*() const { return view->path; }
+        iterator& operator++() { view->advance(); return *this; }
+        void operator++(int) { view->advance(); }
+        friend bool operator==(const iterator& it, default_sentinel_t) { return it.exhausted(); }
+
+    private:
+        TraceView* view = nullptr;
+
+        [[nodiscard]] bool exhausted() const { return view->frames.empty(); }
+    };
+
+    // Searches the subtree below prefix, a path with the given latency; an
+    // empty prefix yields nothing. latencies_to, if given, is the result of
+    // Graph::latencies_to(end_id) and prunes the search.
+    TraceView(const Graph& graph, const vector<uint32_t>& prefix, int latency, optional<uint32_t> end_id, int min_hops,
+              int max_hops, int max_latency, shared_ptr<const vector<int>> latencies_to = nullptr);
+
+    [[nodiscard]] iterator begin();
+    [[nodiscard]] default_sentinel_t end() const { return default_sentinel; }
 
-  [[nodiscard]] vector<Vertex> vertices() const;
 private:
-    unordered_map<pair<Vertex, Vertex>, int, pair_hash> graph{};
+    // one frame per vertex on the current path, with the next out-edge to try
+    struct Frame {
+        uint32_t vertex;
+        uint32_t next_edge;
+        int latency;
+    };
+
+    const Graph* graph;
+    uint32_t end_id = 0;
+    int base_hops = 0;
+    int min_hops;
+    int max_hops;
+    int max_latency;
+    shared_ptr<const vector<int>> latencies_to;
+    vector<Frame> frames{};
+    vector<Vertex> path{};
+    bool started = false;
 
+    void advance();
 };
 
-Graph<vector<pair<pair<char, char>, int>>::const_iterator, vector<char>::const_iterator, char> from_edges_str(const string &edges_str);
+using CharGraph = Graph<vector<pair<pair<char, char>, int>>::const_iterator, vector<char>::const_iterator, char>;
+
+// A malformed record in an edge list, found offset bytes into the input.
+class edge_parse_error : public runtime_error {
+public:
+    edge_parse_error(size_t offset, const string& message);
+
+    [[nodiscard]] size_t offset() const { return offset_; }
+
+private:
+    size_t offset_;
+};
+
+// Parses an edge list like "AB5,BC4" into builder in place, without copying
+// the input. Records are separated by commas or whitespace, and a record is
+// a source character, a target character and a decimal latency. Throws
+// edge_parse_error for a malformed record.
+void parse_edges(string_view edges_str, GraphBuilder<char>& builder);
+
+CharGraph from_edges_str(const string &edges_str);
+// from_edges_str() over a file, which is memory-mapped instead of read.
+CharGraph from_edges_file(const string& path);
+
+using ServiceGraph = Graph<vector<pair<pair<ServiceId, ServiceId>, int>>::const_iterator, vector<ServiceId>::const_iterator, ServiceId>;
+
+// A topology of named services. Queries run on graph with ids from names.
+struct ServiceTopology {
+    ServiceNames names;
+    ServiceGraph graph;
+};
+
+// Parses an edge list of named services like "gateway>auth:12,auth>db:4" into
+// builder, interning the names into names. Records are separated by commas or
+// whitespace, and a name is any non-empty run of other characters except '>'
+// and ':'. Throws edge_parse_error for a malformed record.
+void parse_service_edges(string_view edges_str, ServiceNames& names, GraphBuilder<ServiceId>& builder);
+
+ServiceTopology from_service_edges_str(string_view edges_str);
+
+void write_snapshot(const ServiceTopology& topology, const string& path);
+ServiceTopology load_service_snapshot(const string& path, bool verify = true);
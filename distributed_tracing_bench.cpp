@@ -0,0 +1,472 @@
+#include <benchmark/benchmark.h>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "distributed_tracing.hpp"
+#include "query_cache.hpp"
+#include "small_graph.hpp"
+#include "span_ingest.hpp"
+
+using namespace std;
+
+using IntGraph = Graph<vector<pair<pair<int, int>, int>>::const_iterator, vector<int>::const_iterator, int>;
+
+// The edges of a graph of n vertices in which every vertex has out_degree
+// edges to uniformly chosen vertices with latencies between 1 and 10, grouped
+// by source.
+static vector<pair<pair<int, int>, int>> random_edges(const int n, const int out_degree) {
+    mt19937 rng{42};
+    uniform_int_distribution<int> vertex{0, n - 1};
+    uniform_int_distribution<int> latency{1, 10};
+    vector<pair<pair<int, int>, int>> edges{};
+    for (int u = 0; u < n; u++) {
+        for (int i = 0; i < out_degree; i++) {
+            edges.emplace_back(pair{u, vertex(rng)}, latency(rng));
+        }
+    }
+    return edges;
+}
+
+// The edges of a scale-free graph grown by preferential attachment: every new
+// vertex gets out_degree edges to earlier vertices chosen in proportion to
+// their degree, each edge reversed with probability 1/2 so there are cycles.
+static vector<pair<pair<int, int>, int>> scale_free_edges(const int n, const int out_degree) {
+    mt19937 rng{42};
+    uniform_int_distribution<int> latency{1, 10};
+    vector<pair<pair<int, int>, int>> edges{};
+    // every vertex once per edge end, so a uniform pick is proportional to degree
+    vector<int> ends{0};
+    for (int u = 1; u < n; u++) {
+        for (int i = 0; i < out_degree; i++) {
+            const auto v = ends[rng() % ends.size()];
+            edges.emplace_back(rng() % 2 == 0 ? pair{u, v} : pair{v, u}, latency(rng));
+            ends.push_back(v);
+        }
+        ends.insert(ends.end(), out_degree, u);
+    }
+    return edges;
+}
+
+// The edges of a microservice call graph: 8 layers, from the gateways in the
+// first to the data stores in the last, where every service calls out_degree
+// services of the next layer. Vertex ids go up layer by layer.
+static vector<pair<pair<int, int>, int>> layered_edges(const int n, const int out_degree) {
+    constexpr int layers = 8;
+    mt19937 rng{42};
+    uniform_int_distribution<int> latency{1, 10};
+    const auto width = max(1, n / layers);
+    vector<pair<pair<int, int>, int>> edges{};
+    for (int u = 0; u < n; u++) {
+        const auto next_layer = u / width + 1;
+        if (next_layer >= layers || next_layer * width >= n) {
+            continue;
+        }
+        const auto next_width = min(width, n - next_layer * width);
+        for (int i = 0; i < out_degree; i++) {
+            edges.emplace_back(pair{u, next_layer * width + static_cast<int>(rng() % next_width)}, latency(rng));
+        }
+    }
+    return edges;
+}
+
+using Generator = vector<pair<pair<int, int>, int>> (*)(int, int);
+
+static IntGraph random_graph(const int n, const int out_degree) {
+    const auto edges = random_edges(n, out_degree);
+    return IntGraph{edges.cbegin(), edges.cend()};
+}
+
+// Random walks along existing edges, of up to max_hops hops each, as the
+// vertices of all walks and the offsets where each one starts.
+static pair<vector<int>, vector<size_t>> random_walks(const IntGraph& g, const vector<pair<pair<int, int>, int>>& edges,
+                                                       const int n_walks, const int max_hops) {
+    unordered_map<int, vector<int>> adjacency{};
+    for (const auto& [edge, latency] : edges) {
+        adjacency[edge.first].push_back(edge.second);
+    }
+    const auto vertices = g.vertices();
+    mt19937 rng{7};
+    pair<vector<int>, vector<size_t>> ret{{}, {0}};
+    for (int i = 0; i < n_walks; i++) {
+        auto v = vertices[rng() % vertices.size()];
+        ret.first.push_back(v);
+        for (int hop = 0; hop < max_hops && adjacency.contains(v); hop++) {
+            v = adjacency[v][rng() % adjacency[v].size()];
+            ret.first.push_back(v);
+        }
+        ret.second.push_back(ret.first.size());
+    }
+    return ret;
+}
+
+// The queries over each graph shape run from vertex 0 to vertex n - 1, which
+// are a gateway and a data store in the layered graph. The arguments are the
+// number of vertices, the out-degree and whatever the query needs.
+
+static void BM_shape_traces(benchmark::State& state, Generator generate) {
+    const auto n = static_cast<int>(state.range(0));
+    const auto edges = generate(n, static_cast<int>(state.range(1)));
+    const IntGraph g{edges.cbegin(), edges.cend()};
+    const auto max_hops = static_cast<int>(state.range(2));
+    const auto max_latency = state.range(3) == 0 ? numeric_limits<int>::max() : static_cast<int>(state.range(3));
+    size_t n_traces = 0;
+    for (auto _ : state) {
+        const auto traces = g.traces(0, n - 1, 0, max_hops, max_latency);
+        n_traces = traces.size();
+        benchmark::DoNotOptimize(traces.data());
+    }
+    state.counters["traces"] = static_cast<double>(n_traces);
+}
+// by hops, then by latency with unbounded hops; the bounds differ by shape so
+// that every query finds some traces without running for minutes
+BENCHMARK_CAPTURE(BM_shape_traces, random, random_edges)
+    ->Args({10'000, 8, 5, 0})
+    ->Args({10'000, 8, 6, 0})
+    ->Args({10'000, 8, numeric_limits<int>::max(), 30})
+    ->Args({10'000, 8, numeric_limits<int>::max(), 40})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_shape_traces, scale_free, scale_free_edges)
+    ->Args({10'000, 8, 3, 0})
+    ->Args({10'000, 8, 4, 0})
+    ->Args({10'000, 8, numeric_limits<int>::max(), 15})
+    ->Args({10'000, 8, numeric_limits<int>::max(), 20})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_shape_traces, layered, layered_edges)
+    ->Args({10'000, 8, 7, 0})
+    ->Args({100'000, 8, 7, 0})
+    ->Args({10'000, 8, numeric_limits<int>::max(), 25})
+    ->Args({10'000, 8, numeric_limits<int>::max(), 35})
+    ->Unit(benchmark::kMillisecond);
+
+// the k fastest traces, simple ones if the last argument is set
+static void BM_shape_k_shortest_traces(benchmark::State& state, Generator generate) {
+    const auto n = static_cast<int>(state.range(0));
+    const auto edges = generate(n, static_cast<int>(state.range(1)));
+    const IntGraph g{edges.cbegin(), edges.cend()};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(g.k_shortest_traces(0, n - 1, static_cast<size_t>(state.range(2)), state.range(3) != 0));
+    }
+}
+BENCHMARK_CAPTURE(BM_shape_k_shortest_traces, random, random_edges)
+    ->Args({10'000, 8, 10, 1})
+    ->Args({10'000, 8, 100, 1})
+    ->Args({10'000, 8, 100, 0})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_shape_k_shortest_traces, layered, layered_edges)
+    ->Args({10'000, 8, 10, 1})
+    ->Args({10'000, 8, 100, 1})
+    ->Args({10'000, 8, 100, 0})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_shape_average_latency(benchmark::State& state, Generator generate) {
+    const auto edges = generate(static_cast<int>(state.range(0)), static_cast<int>(state.range(1)));
+    const IntGraph g{edges.cbegin(), edges.cend()};
+    constexpr int n_walks = 10'000;
+    const auto [vertices, offsets] = random_walks(g, edges, n_walks, 5);
+    for (auto _ : state) {
+        for (int i = 0; i < n_walks; i++) {
+            benchmark::DoNotOptimize(
+                g.average_latency(vertices.cbegin() + static_cast<ptrdiff_t>(offsets[i]),
+                                  vertices.cbegin() + static_cast<ptrdiff_t>(offsets[i + 1])));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n_walks);
+}
+BENCHMARK_CAPTURE(BM_shape_average_latency, random, random_edges)
+    ->Args({10'000, 8})
+    ->Args({1'000'000, 8})
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_shape_average_latency, scale_free, scale_free_edges)
+    ->Args({10'000, 8})
+    ->Args({1'000'000, 8})
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_shape_average_latency, layered, layered_edges)
+    ->Args({10'000, 8})
+    ->Args({1'000'000, 8})
+    ->Unit(benchmark::kMicrosecond);
+
+static void BM_shape_vertices(benchmark::State& state, Generator generate) {
+    const auto edges = generate(static_cast<int>(state.range(0)), static_cast<int>(state.range(1)));
+    const IntGraph g{edges.cbegin(), edges.cend()};
+    for (auto _ : state) {
+        // the sum makes the view's contents count, not just its creation
+        int64_t sum = 0;
+        for (const auto v : g.vertices()) {
+            sum += v;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+}
+BENCHMARK_CAPTURE(BM_shape_vertices, random, random_edges)
+    ->Args({10'000, 8})
+    ->Args({1'000'000, 8})
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_shape_vertices, scale_free, scale_free_edges)
+    ->Args({10'000, 8})
+    ->Args({1'000'000, 8})
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_shape_vertices, layered, layered_edges)
+    ->Args({10'000, 8})
+    ->Args({1'000'000, 8})
+    ->Unit(benchmark::kMicrosecond);
+
+static void BM_shape_from_service_edges_str(benchmark::State& state, Generator generate) {
+    const auto edges = generate(static_cast<int>(state.range(0)), static_cast<int>(state.range(1)));
+    string edges_str{};
+    for (const auto& [edge, latency] : edges) {
+        edges_str += "svc" + std::to_string(edge.first) + ">svc" + std::to_string(edge.second) + ":" +
+                     std::to_string(latency) + ",";
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(from_service_edges_str(edges_str));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(edges_str.size()));
+}
+BENCHMARK_CAPTURE(BM_shape_from_service_edges_str, random, random_edges)
+    ->Args({10'000, 8})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_shape_from_service_edges_str, scale_free, scale_free_edges)
+    ->Args({10'000, 8})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_shape_from_service_edges_str, layered, layered_edges)
+    ->Args({10'000, 8})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_traces(benchmark::State& state) {
+    const auto g = random_graph(10'000, 10);
+    const auto max_hops = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(g.traces(0, 1, 0, max_hops));
+    }
+}
+BENCHMARK(BM_traces)->Arg(3)->Arg(4)->Arg(5)->Unit(benchmark::kMillisecond);
+
+static void BM_traces_bounded(benchmark::State& state) {
+    const auto g = random_graph(10'000, 10);
+    const auto max_latency = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(g.traces(0, 1, 0, numeric_limits<int>::max(), max_latency));
+    }
+}
+BENCHMARK(BM_traces_bounded)->Arg(15)->Arg(20)->Arg(25)->Unit(benchmark::kMillisecond);
+
+static void BM_traces_parallel(benchmark::State& state) {
+    const auto g = random_graph(10'000, 10);
+    const auto max_hops = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(g.traces(0, 1, 0, max_hops, numeric_limits<int>::max(), ParallelOptions{}));
+    }
+}
+BENCHMARK(BM_traces_parallel)->Arg(5)->Arg(6)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// 256 queries between random vertices, from 16 starts, answered as a batch if
+// the argument is set and one by one otherwise; by hop bound as in BM_traces
+static vector<IntGraph::TraceQuery> random_queries(const int n, const int max_hops) {
+    mt19937 rng{7};
+    vector<IntGraph::TraceQuery> ret{};
+    for (int i = 0; i < 256; i++) {
+        ret.push_back({static_cast<int>(rng() % 16), static_cast<int>(rng() % n), 0, max_hops});
+    }
+    return ret;
+}
+
+static void BM_traces_batch(benchmark::State& state) {
+    const auto g = random_graph(10'000, 10);
+    const auto queries = random_queries(10'000, 5);
+    for (auto _ : state) {
+        if (state.range(0) != 0) {
+            benchmark::DoNotOptimize(g.traces(queries));
+        } else {
+            for (const auto& [start, end, min_hops, max_hops, max_latency] : queries) {
+                benchmark::DoNotOptimize(g.traces(start, end, min_hops, max_hops, max_latency));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(queries.size()));
+}
+BENCHMARK(BM_traces_batch)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_count_traces_batch(benchmark::State& state) {
+    const auto g = random_graph(10'000, 10);
+    const auto queries = random_queries(10'000, 12);
+    for (auto _ : state) {
+        if (state.range(0) != 0) {
+            benchmark::DoNotOptimize(g.count_traces(queries));
+        } else {
+            for (const auto& [start, end, min_hops, max_hops, max_latency] : queries) {
+                benchmark::DoNotOptimize(g.count_traces(start, end, min_hops, max_hops, max_latency));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(queries.size()));
+}
+BENCHMARK(BM_count_traces_batch)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// the queries of BM_traces_batch repeated through a cache, as a dashboard
+// would; the first round misses
+static void BM_query_cache(benchmark::State& state) {
+    const auto g = random_graph(10'000, 10);
+    const auto queries = random_queries(10'000, 4);
+    QueryCache<IntGraph> cache{};
+    for (auto _ : state) {
+        for (const auto& [start, end, min_hops, max_hops, max_latency] : queries) {
+            benchmark::DoNotOptimize(cache.traces(g, start, end, min_hops, max_hops, max_latency));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(queries.size()));
+}
+BENCHMARK(BM_query_cache);
+
+static void BM_all_pairs(benchmark::State& state) {
+    const auto g = random_graph(static_cast<int>(state.range(0)), static_cast<int>(state.range(1)));
+    const auto method = state.range(2) == 0 ? AllPairsMethod::floyd_warshall : AllPairsMethod::dijkstra;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(g.all_pairs(false, method, ParallelOptions{}));
+    }
+}
+BENCHMARK(BM_all_pairs)
+    ->Args({512, 64, 0})
+    ->Args({512, 64, 1})
+    ->Args({2048, 4, 0})
+    ->Args({2048, 4, 1})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// counting on a 64-vertex graph, with the CSR Graph (0) or the bitmask SmallGraph (1)
+static void BM_small_count_traces(benchmark::State& state) {
+    const auto edges = random_edges(64, 4);
+    const IntGraph g{edges.cbegin(), edges.cend()};
+    const SmallGraph<int> small{edges};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(state.range(0) == 0 ? g.count_traces(0, 1, 0, 8) : small.count_traces(0, 1, 0, 8));
+    }
+}
+BENCHMARK(BM_small_count_traces)->Arg(0)->Arg(1);
+
+// counting the traces of up to a million hops around a ring of n vertices
+static void BM_count_traces_by_matrix_power(benchmark::State& state) {
+    const auto n = static_cast<int>(state.range(0));
+    vector<pair<pair<int, int>, int>> edges{};
+    for (int u = 0; u < n; u++) {
+        edges.emplace_back(pair{u, (u + 1) % n}, 1);
+    }
+    const IntGraph g{edges.cbegin(), edges.cend()};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(g.count_traces_by_matrix_power(0, 1, 0, 1'000'000, ParallelOptions{}));
+    }
+}
+BENCHMARK(BM_count_traces_by_matrix_power)->Arg(64)->Arg(256)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_average_latencies(benchmark::State& state) {
+    const auto edges = random_edges(10'000, 10);
+    const IntGraph g{edges.cbegin(), edges.cend()};
+    // random walks of 5 hops along existing edges
+    mt19937 rng{7};
+    vector<int> vertices{};
+    vector<size_t> offsets{0};
+    for (int64_t i = 0; i < state.range(0); i++) {
+        auto v = static_cast<int>(rng() % 10'000);
+        vertices.push_back(v);
+        for (int hop = 0; hop < 5; hop++) {
+            v = edges[v * 10 + rng() % 10].first.second;
+            vertices.push_back(v);
+        }
+        offsets.push_back(vertices.size());
+    }
+    vector<optional<int>> out(offsets.size() - 1);
+    for (auto _ : state) {
+        g.average_latencies(vertices, offsets, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_average_latencies)->Arg(1'000'000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// p99 of 5-hop walks whose every edge has a histogram of about 50 buckets
+// around its latency
+static void BM_latency_percentiles(benchmark::State& state) {
+    const auto edges = random_edges(10'000, 10);
+    IntGraph g{edges.cbegin(), edges.cend()};
+    mt19937 rng{7};
+    for (const auto& [edge, latency] : edges) {
+        LatencyHistogram histogram{};
+        for (int i = 0; i < 200; i++) {
+            histogram.add(latency + static_cast<int>(rng() % 50));
+        }
+        g.set_latency_histogram(edge.first, edge.second, histogram);
+    }
+    const auto [vertices, offsets] = random_walks(g, edges, static_cast<int>(state.range(0)), 5);
+    vector<optional<int>> out(offsets.size() - 1);
+    for (auto _ : state) {
+        g.latency_percentiles(vertices, offsets, 0.99, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_latency_percentiles)->Arg(10'000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_from_edges_str(benchmark::State& state) {
+    mt19937 rng{42};
+    string edges_str{};
+    for (int64_t i = 0; i < state.range(0); i++) {
+        edges_str += static_cast<char>('A' + rng() % 26);
+        edges_str += static_cast<char>('A' + rng() % 26);
+        edges_str += std::to_string(1 + rng() % 100);
+        edges_str += ',';
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(from_edges_str(edges_str));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(edges_str.size()));
+}
+BENCHMARK(BM_from_edges_str)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// spans of traces in which every call of the layered graph's services goes
+// one layer down, fed in batches of about a megabyte
+static void BM_ingest_text(benchmark::State& state) {
+    const auto edges = layered_edges(1'000, 4);
+    mt19937 rng{42};
+    vector<string> batches{""};
+    int64_t n_spans = 0;
+    for (uint64_t trace = 1; n_spans < state.range(0); trace++) {
+        // a walk from a random gateway down the layers
+        auto u = static_cast<int>(rng() % 125);
+        uint64_t span = 1;
+        auto line = std::to_string(trace) + " 1 - svc" + std::to_string(u) + " " + std::to_string(trace) + " 100\n";
+        for (auto it = ranges::lower_bound(edges, u, {}, [](const auto& e) { return e.first.first; });
+             it != edges.end() && it->first.first == u;
+             it = ranges::lower_bound(edges, u, {}, [](const auto& e) { return e.first.first; })) {
+            const auto& [edge, latency] = *(it + static_cast<ptrdiff_t>(rng() % 4));
+            u = edge.second;
+            line += std::to_string(trace) + " " + std::to_string(span + 1) + " " + std::to_string(span) + " svc" +
+                    std::to_string(u) + " " + std::to_string(trace) + " " + std::to_string(latency) + "\n";
+            span++;
+        }
+        n_spans += static_cast<int64_t>(span);
+        if (batches.back().size() > (1 << 20)) {
+            batches.emplace_back();
+        }
+        batches.back() += line;
+    }
+    for (auto _ : state) {
+        SpanIngestor ingestor{};
+        for (const auto& batch : batches) {
+            ingestor.ingest_text(batch);
+        }
+        benchmark::DoNotOptimize(ingestor.graph());
+    }
+    state.SetItemsProcessed(state.iterations() * n_spans);
+}
+BENCHMARK(BM_ingest_text)->Arg(1'000'000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_load_snapshot(benchmark::State& state) {
+    const auto path = "bench_graph.snapshot"s;
+    random_graph(static_cast<int>(state.range(0)), 5).write_snapshot(path);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(IntGraph::load_snapshot(path));
+    }
+    remove(path.c_str());
+}
+BENCHMARK(BM_load_snapshot)->Arg(10'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
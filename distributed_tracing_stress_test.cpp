@@ -0,0 +1,159 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "distributed_tracing.hpp"
+#include "graph_store.hpp"
+#include "query_cache.hpp"
+#include "work_stealing_pool.hpp"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+
+// Readers query snapshots while a writer keeps publishing versions in which
+// every edge has the latency of the version number. Every reader must see a
+// consistent version that never goes back in time, and all replaced versions
+// must be reclaimed once the readers are gone.
+TEST(GraphStoreStressTest, readers_during_updates) {
+  GraphStore<CharGraph> store{from_edges_str("AB1,BC1,CD1,DC1,DE1,AD1,CE1,EB1,AE1"s)};
+  atomic<bool> stop{false};
+  atomic<int> failures{0};
+  atomic<uint64_t> reads{0};
+
+  vector<jthread> readers{};
+  for (int r = 0; r < 8; r++) {
+    readers.emplace_back([&] {
+      int last = 0;
+      vector<char> trace{'A', 'B', 'C', 'D'};
+      // at least one read each, even if the writer is done before the
+      // reader gets scheduled
+      do {
+        auto g = store.snapshot();
+        auto latency = g->average_latency(trace.cbegin(), trace.cend());
+        auto k = latency ? *latency / 3 : -1;
+        if (!latency || *latency != 3 * k || k < last || g->shortest_latency('B', 'B') != 3 * k ||
+            g->count_traces('C', 'C', 0, 3) != 2) {
+          failures += 1;
+        }
+        last = k;
+        reads += 1;
+      } while (!stop.load());
+    });
+  }
+
+  using Update = CharGraph::EdgeUpdate;
+  for (int k = 2; k <= 2000; k++) {
+    if (k % 2 == 0) {
+      vector<Update> updates{};
+      for (auto [a, b] : {pair{'A', 'B'}, {'B', 'C'}, {'C', 'D'}, {'D', 'C'}, {'D', 'E'}, {'A', 'D'}, {'C', 'E'}, {'E', 'B'},
+                          {'A', 'E'}}) {
+        updates.push_back({a, b, k});
+      }
+      store.update([&](CharGraph& g) { g.apply_updates(updates); });
+    } else {
+      auto edges = "AB,BC,CD,DC,DE,AD,CE,EB,AE"s;
+      string edges_str{};
+      for (size_t i = 0; i < edges.size(); i += 3) {
+        edges_str += edges.substr(i, 2) + to_string(k) + ",";
+      }
+      store.publish(from_edges_str(edges_str));
+    }
+  }
+  stop = true;
+  readers.clear();
+
+  ASSERT_EQ(failures.load(), 0);
+  ASSERT_GT(reads.load(), 0);
+  ASSERT_EQ(store.reclaim(), 0);
+  ASSERT_EQ(store.snapshot()->shortest_latency('A', 'C'), 2 * 2000);
+}
+
+// Readers query through a shared cache while a writer keeps replacing the
+// graph, by updates and by new graphs alike. A cached result must always be
+// the one of the snapshot it was asked for.
+TEST(QueryCacheStressTest, readers_during_updates) {
+  GraphStore<CharGraph> store{from_edges_str("AB1,BC1,CD1,DC1,DE1,AD1,CE1,EB1,AE1"s)};
+  QueryCache<CharGraph> cache{QueryCacheOptions{.max_bytes = 1 << 16, .shards = 4}};
+  atomic<bool> stop{false};
+  atomic<int> failures{0};
+  atomic<uint64_t> reads{0};
+
+  vector<jthread> readers{};
+  for (int r = 0; r < 8; r++) {
+    readers.emplace_back([&, r] {
+      const vector<char> trace{'A', 'B', 'C', 'D'};
+      do {
+        auto g = store.snapshot();
+        if (cache.average_latency(*g, trace) != g->average_latency(trace.cbegin(), trace.cend()) ||
+            *cache.traces(*g, 'A', 'C', 0, r % 4 + 1) != g->traces('A', 'C', 0, r % 4 + 1)) {
+          failures += 1;
+        }
+        reads += 1;
+      } while (!stop.load());
+    });
+  }
+
+  for (int k = 2; k <= 1000; k++) {
+    if (k % 2 == 0) {
+      store.update([&](CharGraph& g) { g.upsert_edge('A', 'B', k); });
+    } else {
+      store.publish(from_edges_str("AB" + to_string(k) + ",BC1,CD1,DC1,DE1,AD1,CE1,EB1,AE1"));
+    }
+  }
+  stop = true;
+  readers.clear();
+
+  ASSERT_EQ(failures.load(), 0);
+  ASSERT_GT(reads.load(), 0);
+}
+
+// Query threads share the default pool for their parallel queries, which
+// must neither lose nor repeat each other's tasks.
+TEST(WorkStealingPoolStressTest, concurrent_parallel_queries) {
+  const auto g = from_edges_str("AB5,BC4,CD8,DC8,DE6,AD5,CE2,EB3,AE7"s);
+  vector<char> vertices{};
+  vector<size_t> offsets{0};
+  for (int i = 0; i < 1000; i++) {
+    for (const auto v : "ABC"s) {
+      vertices.push_back(v);
+    }
+    offsets.push_back(vertices.size());
+  }
+  using Query = CharGraph::TraceQuery;
+  const vector<Query> queries{{'A', 'C', 0, 4}, {'C', 'C', 0, 8}, {'A', 'E', 1, 5, 30}};
+  vector<uint64_t> expected_counts{};
+  for (const auto& q : queries) {
+    expected_counts.push_back(g.count_traces(q.start_node, q.end_node, q.min_hops, q.max_hops, q.max_latency));
+  }
+  const auto expected_traces = g.traces('C', 'C', 0, 8);
+  atomic<int> failures{0};
+
+  vector<jthread> threads{};
+  for (int t = 0; t < 6; t++) {
+    threads.emplace_back([&] {
+      vector<optional<int>> latencies(offsets.size() - 1);
+      for (int round = 0; round < 200; round++) {
+        // a hole in the results shows a lost task
+        ranges::fill(latencies, nullopt);
+        g.average_latencies(vertices, offsets, latencies);
+        if (ranges::count(latencies, optional<int>{9}) != static_cast<ptrdiff_t>(latencies.size())) {
+          failures += 1;
+        }
+        if (g.count_traces(queries) != expected_counts ||
+            g.traces('C', 'C', 0, 8, numeric_limits<int>::max(), ParallelOptions{}).size() != expected_traces.size()) {
+          failures += 1;
+        }
+      }
+    });
+  }
+  threads.clear();
+  ASSERT_EQ(failures.load(), 0);
+}
@@ -2,7 +2,15 @@
 #include <vector>
 #include <string>
 #include <optional>
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <chrono>
+#include <thread>
 #include "distributed_tracing.hpp"
+#include "query_cache.hpp"
+#include "small_graph.hpp"
+#include "span_ingest.hpp"
 
 using namespace std;
 
@@ -118,3 +126,774 @@ TEST_F(GraphTest, ex10) {
   });
   ASSERT_EQ(count, 7);
 }
+
+// A repeated edge keeps its first latency and unknown services have no traces.
+TEST(GraphAdjacencyTest, duplicate_edges_and_unknown_vertices) {
+  auto g = from_edges_str("AB5,AB7,BC1"s);
+  vector<char> v{'A', 'B', 'C'};
+  auto v_begin = v.begin();
+  auto v_end = v.end();
+  ASSERT_EQ(g.average_latency(v_begin, v_end), 6);
+  ASSERT_EQ(g.traces('A', 'C', 0, 3).size(), 1);
+  ASSERT_TRUE(g.traces('A', 'Z', 0, 3).empty());
+  ASSERT_TRUE(g.traces('Z', 'A', 0, 3).empty());
+}
+
+// The vertex set is cached and exposed as a view.
+TEST_F(GraphTest, vertices) {
+  auto vertices = g.vertices();
+  ASSERT_EQ(vertices.size(), NODES.size());
+  ASSERT_TRUE(ranges::is_permutation(vertices, NODES));
+  ASSERT_EQ(g.vertices().data(), vertices.data());
+}
+
+// 8. with Dijkstra: the shortest trace between A and C.
+TEST_F(GraphTest, shortest_trace_ex8) {
+  ASSERT_EQ(g.shortest_latency('A', 'C'), 9);
+  auto trace = g.shortest_trace('A', 'C');
+  ASSERT_TRUE(trace);
+  ASSERT_EQ(trace->first, (vector<char>{'A', 'B', 'C'}));
+  ASSERT_EQ(trace->second, 9);
+}
+
+// 9. with Dijkstra: the shortest cycle through B.
+TEST_F(GraphTest, shortest_trace_ex9) {
+  auto trace = g.shortest_trace('B', 'B');
+  ASSERT_TRUE(trace);
+  ASSERT_EQ(trace->first, (vector<char>{'B', 'C', 'E', 'B'}));
+  ASSERT_EQ(trace->second, 9);
+  ASSERT_EQ(g.shortest_latency('A', 'A'), nullopt);
+  ASSERT_EQ(g.shortest_latency('A', 'Z'), nullopt);
+}
+
+// 6., 7. and 10. counted without enumerating the traces.
+TEST_F(GraphTest, count_traces) {
+  ASSERT_EQ(g.count_traces('C', 'C', 0, 3), 2);
+  ASSERT_EQ(g.count_traces('A', 'C', 4, 4), 3);
+  ASSERT_EQ(g.count_traces('C', 'C', 0, numeric_limits<int>::max(), 29), 7);
+  ASSERT_EQ(g.count_traces('C', 'C', 2, 6, 29), g.traces('C', 'C', 2, 6, 29).size());
+  ASSERT_EQ(g.count_traces('A', 'Z', 0, 3), 0);
+}
+
+// A doubling graph overflows a 64-bit count after 64 hops.
+TEST(GraphCountTest, overflow) {
+  auto g = from_edges_str("AB1,AC1,BA1,CA1"s);
+  ASSERT_EQ(g.count_traces('A', 'A', 0, 2 * 63), numeric_limits<uint64_t>::max() - 1);
+  ASSERT_THROW((void)g.count_traces('A', 'A', 0, 2 * 64), overflow_error);
+}
+
+// Walks that overflow but can never reach the end of the query do not count:
+// the doubling part of the graph lies behind A-C, away from B.
+TEST(GraphCountTest, overflow_away_from_end) {
+  const auto g = from_edges_str("AB1,AC1,CD1,CE1,DC1,EC1,DE1,ED1"s);
+  ASSERT_EQ(g.count_traces('A', 'B', 0, 100), 1);
+  ASSERT_EQ(g.count_traces_by_matrix_power('A', 'B', 0, 100), 1);
+  using Query = CharGraph::TraceQuery;
+  const vector<Query> queries{{'A', 'B', 0, 100}, {'A', 'D', 2, 3}, {'C', 'B', 0, 100}};
+  ASSERT_EQ(g.count_traces(queries), (vector<uint64_t>{1, 2, 0}));
+  ASSERT_THROW((void)g.count_traces('A', 'C', 0, 100), overflow_error);
+}
+
+// Zero-latency cycles only make the count infinite if the hops are unbounded
+// and the cycle lies on a trace within the budget.
+TEST(GraphCountTest, zero_latency_cycles) {
+  const auto loop = from_edges_str("AA0"s);
+  ASSERT_EQ(loop.count_traces('A', 'A', 0, 5, 3), 5);
+  ASSERT_EQ(loop.count_traces('A', 'A', 0, 5, 3), loop.traces('A', 'A', 0, 5, 3).size());
+  ASSERT_THROW((void)loop.count_traces('A', 'A', 0, numeric_limits<int>::max(), 3), overflow_error);
+
+  // the cycle at C never gets back to B
+  const auto dead_end = from_edges_str("AB1,AC0,CC0"s);
+  ASSERT_EQ(dead_end.count_traces('A', 'B', 0, numeric_limits<int>::max(), 5), 1);
+  ASSERT_EQ(dead_end.count_traces('A', 'B', 0, 100, 5), 1);
+  ASSERT_THROW((void)dead_end.count_traces('A', 'C', 0, numeric_limits<int>::max(), 5), overflow_error);
+  ASSERT_EQ(dead_end.count_traces('A', 'C', 2, 4, 5), 3);
+
+  // the cycle at C is on the way to D, but only within a budget of 2
+  const auto detour = from_edges_str("AB1,BD0,AC1,CC0,CD1"s);
+  ASSERT_EQ(detour.count_traces('A', 'D', 0, numeric_limits<int>::max(), 1), 1);
+  ASSERT_THROW((void)detour.count_traces('A', 'D', 0, numeric_limits<int>::max(), 2), overflow_error);
+  for (int max_hops = 1; max_hops <= 6; max_hops++) {
+    ASSERT_EQ(detour.count_traces('A', 'D', 0, max_hops, 2), detour.traces('A', 'D', 0, max_hops, 2).size());
+  }
+}
+
+// 10. enumerated lazily: the same traces as traces(), one at a time.
+TEST_F(GraphTest, lazy_traces) {
+  auto view = g.lazy_traces('C', 'C', 0, numeric_limits<int>::max(), 29);
+  static_assert(ranges::input_range<decltype(view)>);
+  vector<vector<char>> lazy{};
+  for (auto trace : view) {
+    lazy.emplace_back(trace.begin(), trace.end());
+  }
+  auto eager = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29);
+  ASSERT_EQ(lazy.size(), 7);
+  ASSERT_TRUE(ranges::is_permutation(lazy, eager));
+
+  auto first = g.lazy_traces('A', 'C', 4, 4);
+  auto it = first.begin();
+  ASSERT_NE(it, first.end());
+  ASSERT_EQ((*it).size(), 5);
+  ASSERT_EQ(ranges::distance(g.lazy_traces('A', 'Z', 0, 3)), 0);
+}
+
+// 6., 7. and 10. searched and counted on a work-stealing pool.
+TEST_F(GraphTest, parallel_traces) {
+  WorkStealingPool pool{4};
+  for (int split_hops : {0, 1, 2, 5}) {
+    ParallelOptions options{&pool, split_hops, true};
+    auto parallel = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29, options);
+    vector<vector<char>> lazy{};
+    for (auto trace : g.lazy_traces('C', 'C', 0, numeric_limits<int>::max(), 29)) {
+      lazy.emplace_back(trace.begin(), trace.end());
+    }
+    ASSERT_EQ(parallel, lazy);
+    ASSERT_EQ(g.traces('A', 'C', 4, 4, numeric_limits<int>::max(), options).size(), 3);
+  }
+  ParallelOptions unordered{&pool, 1, false};
+  ASSERT_EQ(g.traces('C', 'C', 0, 3, numeric_limits<int>::max(), unordered).size(), 2);
+  ASSERT_EQ(g.count_traces('C', 'C', 0, 3, numeric_limits<int>::max(), unordered), 2);
+  ASSERT_EQ(g.count_traces('A', 'C', 4, 4, numeric_limits<int>::max(), unordered), 3);
+  ASSERT_EQ(g.count_traces('C', 'C', 0, numeric_limits<int>::max(), 29, unordered), 7);
+  ASSERT_EQ(g.count_traces('C', 'C', 2, 6, 29, unordered), g.count_traces('C', 'C', 2, 6, 29));
+}
+
+// 1. to 5. scored as one batch.
+TEST_F(GraphTest, average_latencies) {
+  vector<char> vertices{'A', 'B', 'C', 'A', 'D', 'A', 'D', 'C', 'A', 'E', 'B', 'C', 'D', 'A', 'E', 'D', 'A', 'Z'};
+  vector<size_t> offsets{0, 3, 5, 8, 13, 16, 18};
+  vector<optional<int>> latencies(offsets.size() - 1);
+  WorkStealingPool pool{3};
+  g.average_latencies(vertices, offsets, latencies, ParallelOptions{&pool});
+  ASSERT_EQ(latencies, (vector<optional<int>>{9, 5, 13, 22, nullopt, nullopt}));
+}
+
+// Malformed records are reported with their byte offset.
+TEST(EdgeParserTest, errors) {
+  auto offset_of = [](const string& edges) -> optional<size_t> {
+    try {
+      (void)from_edges_str(edges);
+    } catch (const edge_parse_error& e) {
+      return e.offset();
+    }
+    return nullopt;
+  };
+  ASSERT_EQ(offset_of("AB5,BC4\n"s), nullopt);
+  ASSERT_EQ(offset_of("AB5,B,CD1"s), 4);
+  ASSERT_EQ(offset_of("AB5,BCx"s), 6);
+  ASSERT_EQ(offset_of("AB5,BC4x"s), 6);
+  ASSERT_EQ(offset_of("AB99999999999"s), 2);
+  ASSERT_EQ(offset_of("AB5,C"s), 4);
+}
+
+// A topology file is memory-mapped and parsed in place.
+TEST(EdgeParserTest, file) {
+  auto path = testing::TempDir() + "graph.csv";
+  FILE* f = fopen(path.c_str(), "w");
+  fputs("AB5,BC4,CD8,DC8,DE6,AD5,CE2,EB3,AE7\n", f);
+  fclose(f);
+  auto g = from_edges_file(path);
+  ASSERT_EQ(g.shortest_latency('A', 'C'), 9);
+  ASSERT_EQ(g.count_traces('C', 'C', 0, numeric_limits<int>::max(), 29), 7);
+  remove(path.c_str());
+  ASSERT_THROW(from_edges_file(path), system_error);
+}
+
+// Named services are interned into dense ids and mapped back for output.
+TEST(ServiceGraphTest, named_services) {
+  auto [names, g] = from_service_edges_str("gateway>auth:5,auth>orders-db:4,orders-db>cache:8,cache>orders-db:8,"
+                                           "cache>search:6,gateway>cache:5,orders-db>search:2,search>auth:3,gateway>search:7");
+  ASSERT_EQ(names.size(), 5);
+  auto gateway = *names.find("gateway");
+  auto db = *names.find("orders-db");
+  ASSERT_EQ(names.find("billing"), nullopt);
+  auto trace = g.shortest_trace(gateway, db);
+  ASSERT_TRUE(trace);
+  ASSERT_EQ(names.names_of(trace->first), (vector<string_view>{"gateway", "auth", "orders-db"}));
+  ASSERT_EQ(trace->second, 9);
+  ASSERT_EQ(g.count_traces(db, db, 0, numeric_limits<int>::max(), 29), 7);
+
+  ServiceNames more{};
+  GraphBuilder<ServiceId> builder{};
+  ASSERT_THROW(parse_service_edges("a>b:1,a:3"s, more, builder), edge_parse_error);
+  ASSERT_THROW(parse_service_edges("a>b>c:1"s, more, builder), edge_parse_error);
+  ASSERT_THROW(parse_service_edges(">b:1"s, more, builder), edge_parse_error);
+  ASSERT_THROW(parse_service_edges("a>b:x"s, more, builder), edge_parse_error);
+}
+
+// A snapshot loads back into a graph that answers the same queries.
+TEST_F(GraphTest, snapshot) {
+  auto path = testing::TempDir() + "graph.snapshot";
+  g.write_snapshot(path);
+  auto loaded = decltype(g)::load_snapshot(path);
+  ASSERT_TRUE(ranges::equal(loaded.vertices(), g.vertices()));
+  ASSERT_EQ(loaded.traces('C', 'C', 0, 3), g.traces('C', 'C', 0, 3));
+  ASSERT_EQ(loaded.count_traces('C', 'C', 0, numeric_limits<int>::max(), 29), 7);
+  ASSERT_EQ(loaded.shortest_latency('B', 'B'), 9);
+
+  // flip a byte of the latencies
+  FILE* f = fopen(path.c_str(), "r+b");
+  fseek(f, -8, SEEK_END);
+  int c = fgetc(f);
+  fseek(f, -8, SEEK_END);
+  fputc(c ^ 1, f);
+  fclose(f);
+  ASSERT_THROW((void)decltype(g)::load_snapshot(path), runtime_error);
+  (void)decltype(g)::load_snapshot(path, nullptr, false);
+  remove(path.c_str());
+}
+
+// A service topology snapshot carries its name table.
+TEST(ServiceGraphTest, snapshot) {
+  auto topology = from_service_edges_str("gateway>auth:5,auth>orders-db:4,gateway>orders-db:12"s);
+  auto path = testing::TempDir() + "services.snapshot";
+  write_snapshot(topology, path);
+  auto [names, g] = load_service_snapshot(path);
+  ASSERT_EQ(names.size(), 3);
+  auto trace = g.shortest_trace(*names.find("gateway"), *names.find("orders-db"));
+  ASSERT_TRUE(trace);
+  ASSERT_EQ(names.names_of(trace->first), (vector<string_view>{"gateway", "auth", "orders-db"}));
+
+  // ids interned before would shift the snapshot's
+  ServiceNames used{};
+  used.intern("auth");
+  ASSERT_THROW((void)ServiceGraph::load_snapshot(path, &used), runtime_error);
+  remove(path.c_str());
+}
+
+// Latency refreshes are applied in place, added and removed edges rebuild the
+// adjacency, and every effective change bumps the generation.
+TEST_F(GraphTest, edge_updates) {
+  auto original = g;
+  ASSERT_EQ(g.generation(), 0);
+  g.upsert_edge('B', 'C', 1);
+  ASSERT_EQ(g.generation(), 1);
+  ASSERT_EQ(g.shortest_latency('A', 'C'), 6);
+  ASSERT_EQ(original.shortest_latency('A', 'C'), 9);
+  g.upsert_edge('B', 'C', 1);
+  ASSERT_EQ(g.generation(), 1);
+
+  g.upsert_edge('C', 'F', 1);
+  ASSERT_EQ(g.generation(), 2);
+  ASSERT_EQ(g.vertices().size(), NODES.size() + 1);
+  ASSERT_EQ(g.shortest_latency('A', 'F'), 7);
+  ASSERT_TRUE(g.remove_edge('C', 'F'));
+  ASSERT_FALSE(g.remove_edge('C', 'F'));
+  ASSERT_EQ(g.generation(), 3);
+  ASSERT_TRUE(ranges::equal(g.vertices(), original.vertices()));
+
+  using Update = decltype(g)::EdgeUpdate;
+  vector<Update> updates{{'B', 'C', 4}, {'A', 'B', nullopt}, {'A', 'B', 6}, {'A', 'E', nullopt}};
+  g.apply_updates(updates);
+  ASSERT_EQ(g.generation(), 4);
+  ASSERT_EQ(g.shortest_latency('A', 'C'), 10);
+  ASSERT_EQ(g.count_traces('C', 'C', 0, numeric_limits<int>::max(), 29), 7);
+  ASSERT_EQ(g.traces('A', 'E', 1, 1).size(), 0);
+}
+
+// Batches that change nothing keep the version, so the results cached for it
+// stay valid, also on a graph mapped from a snapshot.
+TEST_F(GraphTest, no_op_updates) {
+  using Update = decltype(g)::EdgeUpdate;
+  const auto version = g.version();
+  g.apply_updates({});
+  const vector<Update> no_ops{{'A', 'B', 5}, {'B', 'C', 4}, {'A', 'Z', nullopt}, {'E', 'A', nullopt}};
+  g.apply_updates(no_ops);
+  ASSERT_EQ(g.version(), version);
+  ASSERT_EQ(g.generation(), 0);
+  ASSERT_TRUE(g.set_latency_histogram('A', 'B', LatencyHistogram{}));
+  ASSERT_EQ(g.version(), version);
+
+  auto path = testing::TempDir() + "graph.snapshot";
+  g.write_snapshot(path);
+  auto loaded = decltype(g)::load_snapshot(path);
+  const auto loaded_version = loaded.version();
+  loaded.apply_updates(no_ops);
+  ASSERT_EQ(loaded.version(), loaded_version);
+  loaded.upsert_edge('A', 'B', 1);
+  ASSERT_GT(loaded.version(), loaded_version);
+  ASSERT_EQ(loaded.shortest_latency('A', 'C'), 5);
+  remove(path.c_str());
+}
+
+// Removing a missing edge and then adding it in the same batch matches
+// applying the updates one by one.
+TEST_F(GraphTest, remove_missing_then_add) {
+  using Update = decltype(g)::EdgeUpdate;
+  const vector<Update> updates{{'A', 'C', nullopt}, {'B', 'A', 2}, {'A', 'C', 3}};
+  auto one_by_one = g;
+  for (const auto& update : updates) {
+    one_by_one.apply_updates(span{&update, 1});
+  }
+  g.apply_updates(updates);
+  const vector<char> ac{'A', 'C'};
+  const vector<char> ba{'B', 'A'};
+  ASSERT_EQ(g.average_latency(ac.cbegin(), ac.cend()), 3);
+  ASSERT_EQ(g.average_latency(ba.cbegin(), ba.cend()), 2);
+  ASSERT_EQ(g.generation(), 1);
+  for (const auto start : NODES) {
+    for (const auto end : NODES) {
+      ASSERT_EQ(g.traces(start, end, 1, 3), one_by_one.traces(start, end, 1, 3));
+    }
+  }
+}
+
+// A graph loaded from a snapshot copies the mapped arrays before changing.
+TEST_F(GraphTest, snapshot_updates) {
+  auto path = testing::TempDir() + "graph.snapshot";
+  g.write_snapshot(path);
+  auto loaded = decltype(g)::load_snapshot(path);
+  loaded.upsert_edge('A', 'B', 1);
+  ASSERT_EQ(loaded.shortest_latency('A', 'C'), 5);
+  ASSERT_EQ(decltype(g)::load_snapshot(path).shortest_latency('A', 'C'), 9);
+
+  // overwriting the file leaves the graphs mapped from it alone
+  auto mapped = decltype(g)::load_snapshot(path);
+  loaded.write_snapshot(path);
+  ASSERT_EQ(mapped.shortest_latency('A', 'C'), 9);
+  ASSERT_EQ(decltype(g)::load_snapshot(path).shortest_latency('A', 'C'), 5);
+  remove(path.c_str());
+}
+
+// 8. and 9. for all pairs at once, with either method.
+TEST_F(GraphTest, all_pairs) {
+  for (auto method : {AllPairsMethod::floyd_warshall, AllPairsMethod::dijkstra}) {
+    auto all = g.all_pairs(true, method);
+    ASSERT_EQ(all.latency('A', 'C'), 9);
+    ASSERT_EQ(all.latency('B', 'B'), 9);
+    ASSERT_EQ(all.latency('A', 'A'), nullopt);
+    ASSERT_EQ(all.latency('A', 'Z'), nullopt);
+    for (auto u : NODES) {
+      for (auto v : NODES) {
+        auto trace = g.shortest_trace(u, v);
+        ASSERT_EQ(all.latency(u, v), g.shortest_latency(u, v));
+        ASSERT_EQ(all.trace(u, v), trace ? optional{trace->first} : nullopt);
+      }
+    }
+  }
+  ASSERT_EQ(g.all_pairs().trace('A', 'C'), nullopt);
+}
+
+// Both methods agree on a graph spanning several Floyd-Warshall blocks.
+TEST(AllPairsTest, methods_agree) {
+  GraphBuilder<int> builder{};
+  for (int u = 0; u < 150; u++) {
+    builder.add_edge(u, (u * 7 + 3) % 150, u % 10 + 1);
+    builder.add_edge(u, (u * 13 + 5) % 150, u % 7 + 1);
+  }
+  Graph<vector<pair<pair<int, int>, int>>::const_iterator, vector<int>::const_iterator, int> g{move(builder)};
+  auto fw = g.all_pairs(true, AllPairsMethod::floyd_warshall);
+  auto dijkstra = g.all_pairs(true, AllPairsMethod::dijkstra);
+  for (int u = 0; u < 150; u++) {
+    for (int v = 0; v < 150; v++) {
+      ASSERT_EQ(fw.latency(u, v), g.shortest_latency(u, v));
+      ASSERT_EQ(dijkstra.latency(u, v), fw.latency(u, v));
+      auto trace = fw.trace(u, v);
+      if (trace) {
+        ASSERT_EQ(g.average_latency(trace->cbegin(), trace->cend()), fw.latency(u, v));
+      }
+    }
+  }
+}
+
+// Cheap cycles that never lead to the end are cut right away, instead of
+// being walked until the latency bound runs out (2^30 paths here).
+TEST(GraphPruningTest, dead_ends) {
+  auto g = from_edges_str("AB5,AC1,CD1,DC1,CE1,EC1"s);
+  ASSERT_EQ(g.traces('A', 'B', 0, numeric_limits<int>::max(), 60), (vector<vector<char>>{{'A', 'B'}}));
+  ASSERT_EQ(g.traces('A', 'B', 0, numeric_limits<int>::max(), 60, ParallelOptions{}).size(), 1);
+  ASSERT_EQ(ranges::distance(g.lazy_traces('A', 'B', 0, numeric_limits<int>::max(), 60)), 1);
+  ASSERT_TRUE(g.traces('A', 'B', 0, numeric_limits<int>::max(), 4).empty());
+}
+
+// 6. and 5. with statistics, which also add up process-wide.
+TEST_F(GraphTest, query_stats) {
+  const auto queries = query_stats_totals().queries.load();
+  QueryStats stats{};
+  ASSERT_EQ(g.traces('C', 'C', 0, 3, numeric_limits<int>::max(), stats), g.traces('C', 'C', 0, 3));
+  ASSERT_EQ(stats.expanded_per_hop, (vector<uint64_t>{1, 2, 3}));
+  ASSERT_EQ(stats.peak_frontier, 4);
+  ASSERT_EQ(stats.n_pruned_by_latency, 0);
+  ASSERT_GE(stats.hash_probes, 2);
+  ASSERT_GE(stats.allocations, 3);
+
+  QueryStats bounded{};
+  ASSERT_EQ(g.traces('C', 'C', 0, numeric_limits<int>::max(), 29, bounded).size(), 7);
+  ASSERT_GT(bounded.n_pruned_by_latency, 0);
+
+  vector<char> v{'A', 'E', 'D'};
+  QueryStats missing{};
+  ASSERT_EQ(g.average_latency(v.cbegin(), v.cend(), missing), nullopt);
+  ASSERT_EQ(missing.n_pruned_by_missing_edge, 1);
+  ASSERT_EQ(query_stats_totals().queries.load(), queries + 3);
+  ASSERT_GE(query_stats_totals().peak_frontier.load(), 4);
+}
+
+// 10. within budgets, which cut it short with a partial result.
+TEST_F(GraphTest, query_budget) {
+  const auto all = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29);
+  auto complete = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29, QueryBudget{});
+  ASSERT_EQ(complete.traces, all);
+  ASSERT_EQ(complete.truncation, Truncation::none);
+  ASSERT_EQ(g.traces('C', 'C', 0, numeric_limits<int>::max(), 29, QueryBudget{.max_results = 7}).truncation,
+            Truncation::none);
+
+  auto limited = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29, QueryBudget{.max_results = 3});
+  ASSERT_EQ(limited.traces, vector(all.begin(), all.begin() + 3));
+  ASSERT_EQ(limited.truncation, Truncation::max_results);
+
+  auto expanded = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29, QueryBudget{.max_expanded = 4});
+  ASSERT_EQ(expanded.truncation, Truncation::max_expanded);
+  ASSERT_LT(expanded.traces.size(), all.size());
+
+  auto late = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29,
+                       QueryBudget{.deadline = chrono::steady_clock::now() - 1s});
+  ASSERT_TRUE(late.traces.empty());
+  ASSERT_EQ(late.truncation, Truncation::deadline);
+
+  stop_source stop{};
+  stop.request_stop();
+  auto cancelled = g.traces('C', 'C', 0, numeric_limits<int>::max(), 29, QueryBudget{.stop = stop.get_token()});
+  ASSERT_TRUE(cancelled.traces.empty());
+  ASSERT_EQ(cancelled.truncation, Truncation::cancelled);
+}
+
+// A search that would run for hours is stopped from another thread.
+TEST(GraphBudgetTest, cancel_runaway_query) {
+  auto g = from_edges_str("AB1,BA1,AC1,CA1,BC1,CB1"s);
+  stop_source stop{};
+  jthread canceller{[&] {
+    this_thread::sleep_for(50ms);
+    stop.request_stop();
+  }};
+  auto result = g.traces('A', 'A', 0, numeric_limits<int>::max(), numeric_limits<int>::max(),
+                         QueryBudget{.max_expanded = 1'000'000'000, .stop = stop.get_token()});
+  ASSERT_EQ(result.truncation, Truncation::cancelled);
+  ASSERT_FALSE(result.traces.empty());
+}
+
+// 1., 5., 6. and 7. checked at compile time on the bitmask graph.
+constexpr auto small_g = small_from_edges_str("AB5,BC4,CD8,DC8,DE6,AD5,CE2,EB3,AE7");
+static_assert(small_g.size() == 5);
+static_assert(small_g.average_latency("ABC"sv) == 9);
+static_assert(small_g.average_latency("AED"sv) == nullopt);
+static_assert(small_g.count_traces('C', 'C', 0, 3) == 2);
+static_assert(small_g.count_traces('A', 'C', 4, 4) == 3);
+static_assert(small_g.reaches('A', 'E', 1) && !small_g.reaches('E', 'A', 10));
+static_assert(small_g.count_reachable('A', 1) == 3);
+
+// The bitmask graph agrees with Graph on a graph of 64 vertices.
+TEST(SmallGraphTest, matches_graph) {
+  vector<pair<pair<int, int>, int>> edges{};
+  for (int u = 0; u < 64; u++) {
+    edges.push_back({{u, (u * 7 + 3) % 64}, u % 5 + 1});
+    edges.push_back({{u, (u * 13 + 1) % 64}, u % 3 + 1});
+  }
+  SmallGraph<int> small{edges};
+  Graph<vector<pair<pair<int, int>, int>>::const_iterator, vector<int>::const_iterator, int> g{edges.cbegin(),
+                                                                                              edges.cend()};
+  for (int v = 0; v < 64; v++) {
+    ASSERT_EQ(small.count_traces(0, v, 2, 6), g.count_traces(0, v, 2, 6));
+    ASSERT_EQ(small.reaches(0, v, 3), !g.traces(0, v, 0, 3).empty());
+  }
+  vector<int> trace{0, 3, 24};
+  ASSERT_EQ(small.average_latency(trace), 5);
+  ASSERT_EQ(small.average_latency(trace), g.average_latency(trace.cbegin(), trace.cend()));
+  edges.push_back({{64, 0}, 1});
+  ASSERT_THROW((SmallGraph<int>{edges}), length_error);
+  ASSERT_THROW(small_from_edges_str("AB5,B"), edge_parse_error);
+}
+
+// 6. and 7. by matrix powers, which also handle hop bounds far out of reach of
+// the hop by hop count.
+TEST_F(GraphTest, count_traces_by_matrix_power) {
+  ASSERT_EQ(g.count_traces_by_matrix_power('C', 'C', 0, 3), 2);
+  ASSERT_EQ(g.count_traces_by_matrix_power('A', 'C', 4, 4), 3);
+  for (int max_hops = 1; max_hops <= 40; max_hops++) {
+    ASSERT_EQ(g.count_traces_by_matrix_power('A', 'C', max_hops / 2, max_hops), g.count_traces('A', 'C', max_hops / 2, max_hops));
+  }
+  ASSERT_THROW((void)g.count_traces_by_matrix_power('C', 'C', 0, 1000), overflow_error);
+
+  // every even hop count up to a billion, with a branching part that
+  // overflows but cannot reach the end
+  auto cycle = from_edges_str("AB1,BA1,BC1,CD1,DC1,CE1,EC1,DE1,ED1"s);
+  ASSERT_EQ(cycle.count_traces('A', 'A', 0, 1'000'000'000), 500'000'000);
+  ASSERT_EQ(cycle.count_traces_by_matrix_power('A', 'A', 0, 1'000'000'000), 500'000'000);
+  ASSERT_EQ(cycle.count_traces_by_matrix_power('A', 'A', 999'999'999, 1'000'000'000), 1);
+  ASSERT_THROW((void)cycle.count_traces_by_matrix_power('A', 'C', 0, 1000), overflow_error);
+}
+
+// The k fastest traces match sorting all traces of up to 10 hops, simple
+// ones or any, including the cycles through C.
+TEST_F(GraphTest, k_shortest_traces) {
+  for (const auto& [start, end] : {pair{'A', 'C'}, pair{'C', 'C'}, pair{'A', 'E'}, pair{'B', 'A'}}) {
+    vector<pair<int, vector<char>>> all{};
+    for (auto& trace : g.traces(start, end, 1, 10)) {
+      all.emplace_back(*g.average_latency(trace.cbegin(), trace.cend()), move(trace));
+    }
+    ranges::sort(all);
+    vector<pair<int, vector<char>>> simple{};
+    ranges::copy_if(all, back_inserter(simple), [](const auto& trace) {
+      return set(trace.second.begin() + 1, trace.second.end()).size() == trace.second.size() - 1;
+    });
+    for (const auto& [expected, simple_only] : {pair{&all, false}, pair{&simple, true}}) {
+      const auto found = g.k_shortest_traces(start, end, 8, simple_only);
+      ASSERT_EQ(found.size(), min<size_t>(8, expected->size()));
+      for (size_t i = 0; i < found.size(); i++) {
+        ASSERT_EQ(found[i].second, (*expected)[i].first);
+        ASSERT_EQ(g.average_latency(found[i].first.cbegin(), found[i].first.cend()), found[i].second);
+        if (simple_only) {
+          ASSERT_NE(ranges::find(simple, pair{found[i].second, found[i].first}), simple.end());
+        }
+      }
+    }
+  }
+  ASSERT_EQ(g.k_shortest_traces('A', 'C', 1)[0], (pair{vector<char>{'A', 'B', 'C'}, 9}));
+  ASSERT_TRUE(g.k_shortest_traces('A', 'Z', 3).empty());
+}
+
+// A batch of queries between all pairs of vertices, more than 64 of them with
+// the same start, gets what every query gets on its own.
+TEST_F(GraphTest, query_batch) {
+  using Query = decltype(g)::TraceQuery;
+  vector<Query> queries{};
+  for (const auto start : NODES) {
+    for (const auto end : NODES) {
+      queries.push_back({start, end, 0, 3});
+      queries.push_back({start, end, 2, 6, 30});
+      queries.push_back({start, end, 4, 4});
+    }
+  }
+  for (int max_hops = 0; max_hops < 12; max_hops++) {
+    queries.push_back({'C', 'C', max_hops / 2, max_hops});
+  }
+  for (int max_latency = 0; max_latency < 40; max_latency++) {
+    queries.push_back({'C', 'E', 0, numeric_limits<int>::max(), max_latency});
+  }
+  queries.push_back({'A', 'Z', 1, 3});
+  WorkStealingPool pool{3};
+  const auto traces = g.traces(queries, ParallelOptions{&pool});
+  const auto counts = g.count_traces(queries, ParallelOptions{&pool});
+  ASSERT_EQ(traces.size(), queries.size());
+  for (size_t q = 0; q < queries.size(); q++) {
+    const auto& [start, end, min_hops, max_hops, max_latency] = queries[q];
+    ASSERT_EQ(traces[q], g.traces(start, end, min_hops, max_hops, max_latency));
+    ASSERT_EQ(counts[q], g.count_traces(start, end, min_hops, max_hops, max_latency));
+  }
+  queries.assign({{'C', 'C', 0, 60}, {'A', 'C', 30, 60}, {'A', 'E', 0, 61}});
+  ASSERT_EQ(g.count_traces(queries),
+            (vector<uint64_t>{g.count_traces('C', 'C', 0, 60), g.count_traces('A', 'C', 30, 60),
+                              g.count_traces('A', 'E', 0, 61)}));
+
+  // as on its own, a count too high fails even if another start's is not
+  queries.assign({{'A', 'C', 1, 3}, {'C', 'C', 0, 1000}});
+  ASSERT_THROW((void)g.count_traces(queries), overflow_error);
+}
+
+// Repeated queries hit until the graph changes, a query on a replaced graph
+// does not bring its results back, and a small cache evicts.
+TEST_F(GraphTest, query_cache) {
+  QueryCache<CharGraph> cache{};
+  const auto traces = cache.traces(g, 'C', 'C', 0, 3);
+  ASSERT_EQ(*traces, g.traces('C', 'C', 0, 3));
+  ASSERT_EQ(cache.traces(g, 'C', 'C', 0, 3), traces);
+  const vector<char> abc{'A', 'B', 'C'};
+  ASSERT_EQ(cache.average_latency(g, abc), 9);
+  ASSERT_EQ(cache.average_latency(g, abc), 9);
+  auto stats = cache.stats();
+  ASSERT_EQ(stats.hits, 2);
+  ASSERT_EQ(stats.misses, 2);
+  ASSERT_EQ(stats.entries, 2);
+
+  const auto original = g;
+  ASSERT_EQ(original.version(), g.version());
+  g.upsert_edge('B', 'C', 1);
+  ASSERT_GT(g.version(), original.version());
+  ASSERT_EQ(cache.average_latency(g, abc), 6);
+  ASSERT_EQ(cache.average_latency(original, abc), 9);
+  ASSERT_EQ(cache.average_latency(g, abc), 6);
+  // a graph built anew is newer than everything before it
+  const CharGraph rebuilt{from_edges_str("AB1,BC1"s)};
+  ASSERT_EQ(cache.average_latency(rebuilt, abc), 2);
+  ASSERT_EQ(*cache.traces(rebuilt, 'C', 'C', 0, 3), vector<vector<char>>{});
+  stats = cache.stats();
+  ASSERT_EQ(stats.hits, 3);
+  ASSERT_GE(stats.invalidations, 2);
+
+  QueryCache<CharGraph> small{QueryCacheOptions{.max_bytes = 1024, .shards = 1}};
+  for (int i = 0; i < 100; i++) {
+    (void)small.traces(g, 'A', 'C', 0, i % 10);
+  }
+  stats = small.stats();
+  ASSERT_GT(stats.evictions, 0);
+  ASSERT_LE(stats.bytes, 1024);
+}
+
+// Percentiles of traces whose edges have latency histograms; an edge keeps
+// its histogram through a rebuild but loses it when its latency changes.
+TEST_F(GraphTest, latency_distribution) {
+  LatencyHistogram ab{};
+  ab.add(4);
+  ab.add(6);
+  LatencyHistogram bc{};
+  bc.add(3, 3);
+  bc.add(7);
+  ASSERT_TRUE(g.set_latency_histogram('A', 'B', ab));
+  ASSERT_TRUE(g.set_latency_histogram('B', 'C', bc));
+  ASSERT_FALSE(g.set_latency_histogram('B', 'A', bc));
+  LatencyHistogram coarse{2};
+  coarse.add(8);
+  ASSERT_THROW(g.set_latency_histogram('C', 'D', coarse), invalid_argument);
+  ASSERT_EQ(g.generation(), 2);
+
+  const vector<char> abc{'A', 'B', 'C'};
+  const auto d = g.latency_distribution(abc.begin(), abc.end());
+  ASSERT_TRUE(d);
+  ASSERT_EQ(d->percentile(0.3), 7);
+  ASSERT_EQ(d->percentile(0.5), 9);
+  ASSERT_EQ(d->percentile(0.99), 13);
+  ASSERT_DOUBLE_EQ(d->mean(), 9);
+
+  vector<char> vertices{'A', 'B', 'C', 'D', 'A', 'D', 'A', 'E', 'B', 'A', 'C'};
+  vector<size_t> offsets{0, 4, 6, 9, 11};
+  vector<optional<int>> p99(offsets.size() - 1);
+  WorkStealingPool pool{3};
+  g.latency_percentiles(vertices, offsets, 0.99, p99, ParallelOptions{&pool});
+  ASSERT_EQ(p99, (vector<optional<int>>{21, 5, 10, nullopt}));
+
+  g.remove_edge('A', 'E');
+  g.latency_percentiles(vertices, offsets, 0.99, p99);
+  ASSERT_EQ(p99, (vector<optional<int>>{21, 5, nullopt, nullopt}));
+  g.upsert_edge('B', 'C', 5);
+  g.latency_percentiles(vertices, offsets, 0.99, p99);
+  ASSERT_EQ(p99, (vector<optional<int>>{19, 5, nullopt, nullopt}));
+  g.latency_percentiles(vertices, offsets, 0.5, p99);
+  ASSERT_EQ(p99, (vector<optional<int>>{17, 5, nullopt, nullopt}));
+}
+
+// Certain latencies add up exactly rather than bucket by bucket, and the
+// bucket width is free again once no edge has a histogram.
+TEST(GraphHistogramTest, coarse_buckets) {
+  auto g = from_edges_str("AB9,BC9,CD5"s);
+  LatencyHistogram cd{10};
+  cd.add(5);
+  ASSERT_TRUE(g.set_latency_histogram('C', 'D', cd));
+  const vector<char> abc{'A', 'B', 'C'};
+  const auto point = g.latency_distribution(abc.begin(), abc.end());
+  ASSERT_TRUE(point);
+  ASSERT_EQ(point->percentile(0.5), 18);
+  ASSERT_DOUBLE_EQ(point->mean(), 18);
+  const vector<char> abcd{'A', 'B', 'C', 'D'};
+  ASSERT_EQ(g.latency_distribution(abcd.begin(), abcd.end())->percentile(1), 18);
+
+  LatencyHistogram fine{2};
+  fine.add(4);
+  ASSERT_THROW(g.set_latency_histogram('A', 'B', fine), invalid_argument);
+  ASSERT_TRUE(g.set_latency_histogram('C', 'D', LatencyHistogram{10}));
+  ASSERT_TRUE(g.set_latency_histogram('A', 'B', fine));
+  ASSERT_EQ(g.latency_distribution(abcd.begin(), abcd.end())->percentile(1), 18);
+  g.upsert_edge('A', 'B', 4);
+  ASSERT_TRUE(g.set_latency_histogram('C', 'D', cd));
+}
+
+// The latencies of the fixture's edges A-B-C and A-D-C from spans, with a
+// child that arrives before its parent, one that arrives too late for its
+// parent and a malformed line.
+TEST(SpanIngestTest, joins_spans) {
+  SpanIngestor ingestor{SpanIngestOptions{.window = 1000}};
+  const string spans_str{
+      "a1 1 - A 0 30\n"
+      "a1 2 1 B 1 9\n"
+      "a1 3 2 C 2 4\n"
+      "b2 3 2 C 102 4\n"
+      "b2 1 0 A 100 20\n"
+      "b2 2 1 B 101 5\n"
+      "not a span\n"
+      "c3 1 - A 200 10\n"
+      "c3 2 1 D 201 5\n"
+      "c3 3 2 C 5000 8\n"
+      "c3 4 2 C 2"};
+  ASSERT_EQ(ingestor.ingest_text(spans_str), spans_str.rfind('\n') + 1);
+  auto stats = ingestor.stats();
+  ASSERT_EQ(stats.spans, 9);
+  ASSERT_EQ(stats.malformed, 1);
+  ASSERT_EQ(stats.joined, 5);
+
+  auto& names = ingestor.names();
+  auto g = ingestor.graph();
+  vector<ServiceId> abc{*names.find("A"), *names.find("B"), *names.find("C")};
+  ASSERT_EQ(g.average_latency(abc.cbegin(), abc.cend()), 11);
+  vector<ServiceId> ad{*names.find("A"), *names.find("D")};
+  ASSERT_EQ(g.average_latency(ad.cbegin(), ad.cend()), 5);
+  vector<ServiceId> dc{*names.find("D"), *names.find("C")};
+  ASSERT_EQ(g.average_latency(dc.cbegin(), dc.cend()), nullopt);
+
+  // the late child has pushed the window past everything before it
+  ingestor.ingest_text("d4 9 8 C 10000 1\n");
+  ASSERT_EQ(ingestor.stats().expired, 1);
+  ASSERT_EQ(ingestor.graph(true).vertices().size(), 4);
+  ASSERT_TRUE(ingestor.edge_stats().empty());
+  ASSERT_EQ(ingestor.graph().average_latency(abc.cbegin(), abc.cend()), 11);
+}
+
+// Spans read from a stream in small batches, with a graph every few spans.
+TEST(SpanIngestTest, stream) {
+  string spans_str{};
+  for (int trace = 1; trace <= 100; trace++) {
+    spans_str += to_string(trace) + " 1 - A " + to_string(trace) + " 10\n";
+    spans_str += to_string(trace) + " 2 1 B " + to_string(trace) + " " + to_string(trace % 3 + 1) + "\n";
+  }
+  spans_str.pop_back();
+  istringstream in{spans_str};
+  SpanIngestor ingestor{};
+  vector<ServiceGraph> graphs{};
+  ingest_spans(in, ingestor, 50, [&](ServiceGraph g) { graphs.push_back(move(g)); }, 64);
+  ASSERT_GE(graphs.size(), 4);
+  ASSERT_EQ(ingestor.stats().spans, 200);
+  ASSERT_EQ(ingestor.stats().joined, 100);
+  ASSERT_EQ(ingestor.stats().malformed, 0);
+  auto a = *ingestor.names().find("A");
+  auto b = *ingestor.names().find("B");
+  vector<ServiceId> ab{a, b};
+  for (const auto& g : graphs) {
+    auto latency = g.average_latency(ab.cbegin(), ab.cend());
+    ASSERT_TRUE(latency && *latency >= 1 && *latency <= 3);
+  }
+}
+
+// Edges beyond the capacity of an accumulator shard are dropped and counted,
+// before and after a reset alike.
+TEST(SpanIngestTest, edge_capacity) {
+  WorkStealingPool pool{1};
+  SpanIngestor ingestor{SpanIngestOptions{.max_edges = 2, .pool = &pool}};
+  ingestor.ingest_text("a1 1 - A 0 30\na1 2 1 B 1 9\na1 3 1 C 2 4\na1 4 1 D 3 5\n");
+  ASSERT_EQ(ingestor.stats().edges, 2);
+  ASSERT_EQ(ingestor.stats().joined, 2);
+  ASSERT_EQ(ingestor.stats().dropped, 1);
+  ASSERT_EQ(ingestor.graph(true).vertices().size(), 3);
+  ingestor.ingest_text("b2 1 - A 10 30\nb2 2 1 D 11 5\n");
+  ASSERT_EQ(ingestor.stats().dropped, 2);
+  ASSERT_EQ(ingestor.graph(true).vertices().size(), 3);
+}
+
+// An edge not observed since the last reset keeps its latency in the graph,
+// and one observed again gets the mean of the new observations.
+TEST(SpanIngestTest, reset_keeps_unseen_edges) {
+  SpanIngestor ingestor{};
+  ingestor.ingest_text("a1 1 - A 0 30\na1 2 1 B 1 9\na1 3 1 C 2 4\n");
+  const auto first = ingestor.graph(true);
+  ingestor.ingest_text("b2 1 - A 10 30\nb2 2 1 B 11 5\n");
+  const auto second = ingestor.graph(true);
+  const auto third = ingestor.graph(true);
+  const auto a = *ingestor.names().find("A");
+  const auto b = *ingestor.names().find("B");
+  const auto c = *ingestor.names().find("C");
+  const vector<ServiceId> ab{a, b};
+  const vector<ServiceId> ac{a, c};
+  ASSERT_EQ(first.average_latency(ab.cbegin(), ab.cend()), 9);
+  ASSERT_EQ(second.average_latency(ab.cbegin(), ab.cend()), 5);
+  ASSERT_EQ(second.average_latency(ac.cbegin(), ac.cend()), 4);
+  ASSERT_EQ(third.average_latency(ab.cbegin(), ab.cend()), 5);
+  ASSERT_EQ(third.average_latency(ac.cbegin(), ac.cend()), 4);
+  ASSERT_TRUE(ingestor.edge_stats().empty());
+}
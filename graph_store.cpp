@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
+
+#include "distributed_tracing.hpp"
+#include "graph_store.hpp"
+
+using namespace std;
+
+template <class G>
+GraphStore<G>::GraphStore(G graph) : current{new G(move(graph))} {}
+
+template <class G>
+GraphStore<G>::~GraphStore() {
+    delete current.load();
+}
+
+template <class G>
+typename GraphStore<G>::Snapshot GraphStore<G>::snapshot() {
+    // start the search for a free slot at a per-thread place so that threads
+    // rarely compete for the same one
+    static thread_local const size_t hint = hash<thread::id>{}(this_thread::get_id());
+    const auto e = epoch.load();
+    for (size_t k = 0;; k++) {
+        const auto slot = (hint + k) % READER_SLOTS;
+        uint64_t free = 0;
+        if (slots[slot].epoch.compare_exchange_strong(free, e)) {
+            // loaded after the slot is claimed, so either the writer that
+            // replaces this version sees the claim or this load sees the
+            // replacement
+            return Snapshot{this, slot, current.load()};
+        }
+        if (k % READER_SLOTS == READER_SLOTS - 1) {
+            this_thread::yield();
+        }
+    }
+}
+
+template <class G>
+void GraphStore<G>::release(const size_t slot) {
+    slots[slot].epoch.store(0);
+    // the last reader of a retired version frees it, unless a writer is busy
+    // and will do so anyway
+    if (n_retired.load() > 0 && writer.try_lock()) {
+        lock_guard lock{writer, adopt_lock};
+        reclaim_locked();
+    }
+}
+
+template <class G>
+void GraphStore<G>::publish(G graph) {
+    auto next = make_unique<const G>(move(graph));
+    lock_guard lock{writer};
+    publish_locked(move(next));
+}
+
+template <class G>
+void GraphStore<G>::update(const function<void(G&)>& change) {
+    lock_guard lock{writer};
+    // only writers free versions, so the current one is safe to copy here
+    auto next = make_unique<G>(*current.load());
+    change(*next);
+    publish_locked(move(next));
+}
+
+template <class G>
+void GraphStore<G>::publish_locked(unique_ptr<const G> next) {
+    unique_ptr<const G> old{current.exchange(next.release())};
+    // readers that claimed a slot up to this epoch may still use old
+    retired.emplace_back(epoch.fetch_add(1), move(old));
+    n_retired.store(retired.size());
+    reclaim_locked();
+}
+
+template <class G>
+size_t GraphStore<G>::reclaim() {
+    lock_guard lock{writer};
+    return reclaim_locked();
+}
+
+template <class G>
+size_t GraphStore<G>::reclaim_locked() {
+    auto oldest = numeric_limits<uint64_t>::max();
+    for (const auto& slot : slots) {
+        const auto e = slot.epoch.load();
+        if (e != 0) {
+            oldest = min(oldest, e);
+        }
+    }
+    erase_if(retired, [oldest](const auto& version) { return version.first < oldest; });
+    n_retired.store(retired.size());
+    return retired.size();
+}
+
+template <class G>
+GraphStore<G>::Snapshot::Snapshot(Snapshot&& other) noexcept
+    : store{exchange(other.store, nullptr)}, slot{other.slot}, graph{other.graph} {}
+
+template <class G>
+GraphStore<G>::Snapshot::~Snapshot() {
+    if (store != nullptr) {
+        store->release(slot);
+    }
+}
+
+template class GraphStore<CharGraph>;
+template class GraphStore<ServiceGraph>;
@@ -0,0 +1,79 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Publishes immutable versions of a graph to many reader threads while a
+// writer replaces them. Readers pin the current version without taking a
+// lock: claiming a reader slot records the epoch they started in. A replaced
+// version is retired with the epoch of its replacement and freed once every
+// claimed slot holds a later epoch, so it outlives its last possible reader.
+template <class G>
+class GraphStore {
+public:
+    // A pinned, read-only version of the graph. Cheap to take and to drop,
+    // but it holds back the reclamation of every version retired while it
+    // lives, so it should not be kept for long.
+    class Snapshot {
+    public:
+        Snapshot(Snapshot&& other) noexcept;
+        Snapshot& operator=(Snapshot&&) = delete;
+        ~Snapshot();
+
+        const G& operator*() const { return *graph; }
+        const G* operator->() const { return graph; }
+
+    private:
+        friend class GraphStore;
+
+        Snapshot(GraphStore* store, size_t slot, const G* graph) : store{store}, slot{slot}, graph{graph} {}
+
+        GraphStore* store;
+        size_t slot;
+        const G* graph;
+    };
+
+    explicit GraphStore(G graph);
+    // all snapshots must have been dropped
+    ~GraphStore();
+    GraphStore(const GraphStore&) = delete;
+    GraphStore& operator=(const GraphStore&) = delete;
+
+    // Lock-free; spins only if more than READER_SLOTS snapshots are alive.
+    [[nodiscard]] Snapshot snapshot();
+
+    // Replaces the current version. Writers are serialized among themselves.
+    void publish(G graph);
+    // Publishes a copy of the current version after change has modified it,
+    // e.g. with Graph::apply_updates(), holding off other writers meanwhile.
+    void update(const function<void(G&)>& change);
+    // Frees the retired versions no reader can still see, returning how many
+    // are left.
+    size_t reclaim();
+
+    static constexpr size_t READER_SLOTS = 128;
+
+private:
+    // one cache line per slot, so readers do not contend on claiming them
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{0};
+    };
+
+    array<Slot, READER_SLOTS> slots{};
+    atomic<const G*> current;
+    atomic<uint64_t> epoch{1};
+    atomic<size_t> n_retired{0};
+    mutex writer{};
+    vector<pair<uint64_t, unique_ptr<const G>>> retired{};
+
+    void release(size_t slot);
+    void publish_locked(unique_ptr<const G> next);
+    size_t reclaim_locked();
+};
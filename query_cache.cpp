@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <bit>
+
+#include "query_cache.hpp"
+
+using namespace std;
+
+template <class G>
+QueryCache<G>::QueryCache(const QueryCacheOptions& options)
+    : max_shard_bytes{options.max_bytes / max(options.shards, size_t{1})} {
+    for (size_t i = 0; i < max(options.shards, size_t{1}); i++) {
+        shards.push_back(make_unique<Shard>());
+    }
+}
+
+template <class G>
+size_t QueryCache<G>::KeyHash::operator()(const Key& key) const {
+    size_t seed = 0;
+    hash_combine(seed, static_cast<uint8_t>(key.kind));
+    hash_combine(seed, key.min_hops);
+    hash_combine(seed, key.max_hops);
+    hash_combine(seed, key.max_latency);
+    for (const auto& v : key.vertices) {
+        hash_combine(seed, v);
+    }
+    return seed;
+}
+
+template <class G>
+shared_ptr<const typename QueryCache<G>::Traces> QueryCache<G>::traces(const G& graph, const Vertex& start_node,
+                                                                      const Vertex& end_node, const int min_hops,
+                                                                      const int max_hops, const int max_latency) {
+    Key key{Kind::traces, {start_node, end_node}, min_hops, max_hops, max_latency};
+    const auto hash = KeyHash{}(key);
+    const auto version = graph.version();
+    if (const auto cached = find(key, hash, version)) {
+        return get<shared_ptr<const Traces>>(*cached);
+    }
+    auto ret = make_shared<const Traces>(graph.traces(start_node, end_node, min_hops, max_hops, max_latency));
+    auto bytes = sizeof(Traces) + ret->capacity() * sizeof(vector<Vertex>);
+    for (const auto& trace : *ret) {
+        bytes += trace.capacity() * sizeof(Vertex);
+    }
+    insert(move(key), hash, version, ret, bytes);
+    return ret;
+}
+
+template <class G>
+optional<int> QueryCache<G>::average_latency(const G& graph, const span<const Vertex> trace) {
+    Key key{Kind::average_latency, {trace.begin(), trace.end()}};
+    const auto hash = KeyHash{}(key);
+    const auto version = graph.version();
+    if (const auto cached = find(key, hash, version)) {
+        return get<optional<int>>(*cached);
+    }
+    const auto ret = graph.average_latency(key.vertices.cbegin(), key.vertices.cend());
+    insert(move(key), hash, version, ret, 0);
+    return ret;
+}
+
+template <class G>
+optional<typename QueryCache<G>::Result> QueryCache<G>::find(const Key& key, const size_t hash,
+                                                             const uint64_t version) {
+    auto& shard = *shards[hash % shards.size()];
+    const lock_guard lock{shard.m};
+    invalidate(shard, version);
+    const auto it = version == shard.version ? shard.index.find(key) : shard.index.end();
+    if (it == shard.index.end()) {
+        shard.stats.misses += 1;
+        return nullopt;
+    }
+    shard.stats.hits += 1;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return it->second->result;
+}
+
+template <class G>
+void QueryCache<G>::insert(Key key, const size_t hash, const uint64_t version, Result result, size_t bytes) {
+    // the key is stored twice, in the list and in the index, and both take a
+    // node
+    bytes += 2 * (sizeof(Key) + key.vertices.capacity() * sizeof(Vertex)) + sizeof(Entry) + 4 * sizeof(void*);
+    auto& shard = *shards[hash % shards.size()];
+    if (bytes > max_shard_bytes) {
+        return;
+    }
+    const lock_guard lock{shard.m};
+    invalidate(shard, version);
+    if (version != shard.version || shard.index.contains(key)) {
+        return;
+    }
+    while (shard.bytes + bytes > max_shard_bytes) {
+        shard.bytes -= shard.entries.back().bytes;
+        shard.index.erase(shard.entries.back().key);
+        shard.entries.pop_back();
+        shard.stats.evictions += 1;
+    }
+    shard.entries.push_front(Entry{key, move(result), bytes});
+    shard.index.emplace(move(key), shard.entries.begin());
+    shard.bytes += bytes;
+}
+
+template <class G>
+void QueryCache<G>::invalidate(Shard& shard, const uint64_t version) {
+    if (version <= shard.version) {
+        return;
+    }
+    shard.stats.invalidations += shard.entries.size();
+    shard.entries.clear();
+    shard.index.clear();
+    shard.bytes = 0;
+    shard.version = version;
+}
+
+template <class G>
+void QueryCache<G>::clear() {
+    for (auto& shard : shards) {
+        const lock_guard lock{shard->m};
+        shard->entries.clear();
+        shard->index.clear();
+        shard->bytes = 0;
+    }
+}
+
+template <class G>
+QueryCacheStats QueryCache<G>::stats() const {
+    QueryCacheStats ret{};
+    for (const auto& shard : shards) {
+        const lock_guard lock{shard->m};
+        ret.hits += shard->stats.hits;
+        ret.misses += shard->stats.misses;
+        ret.evictions += shard->stats.evictions;
+        ret.invalidations += shard->stats.invalidations;
+        ret.entries += shard->entries.size();
+        ret.bytes += shard->bytes;
+    }
+    return ret;
+}
+
+template class QueryCache<CharGraph>;
+template class QueryCache<Graph<vector<pair<pair<int, int>, int>>::const_iterator, vector<int>::const_iterator, int>>;
+template class QueryCache<ServiceGraph>;
@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "distributed_tracing.hpp"
+
+using namespace std;
+
+struct QueryCacheOptions {
+    // what the cached results may take in total, split evenly across the
+    // shards
+    size_t max_bytes = 64 << 20;
+    size_t shards = 16;
+};
+
+struct QueryCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // entries dropped to make room for newer ones
+    uint64_t evictions = 0;
+    // entries dropped because the graph changed since they were computed
+    uint64_t invalidations = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// Remembers the results of traces() and average_latency() queries on a graph
+// and the graphs that replace it, such as the versions of one GraphStore.
+// Every entry is tied to the graph's version(): a query on a newer version
+// drops what its shard holds for older ones, and a query on an older one is
+// computed without the cache. The entries are spread over shards by a hash of
+// the query, each with its own lock and a least-recently-used list, and a
+// shard evicts from its tail once its results take more than its share of
+// max_bytes. Queries are computed outside the lock, so threads missing on the
+// same query at once compute it each.
+template <class G>
+class QueryCache {
+public:
+    using Vertex = ranges::range_value_t<decltype(declval<const G&>().vertices())>;
+    using Traces = vector<vector<Vertex>>;
+
+    explicit QueryCache(const QueryCacheOptions& options = {});
+
+    // G::traces(), shared with the other callers that hit the same entry
+    [[nodiscard]] shared_ptr<const Traces> traces(const G& graph, const Vertex& start_node, const Vertex& end_node,
+                                                  int min_hops, int max_hops,
+                                                  int max_latency = numeric_limits<int>::max());
+    [[nodiscard]] optional<int> average_latency(const G& graph, span<const Vertex> trace);
+
+    void clear();
+    [[nodiscard]] QueryCacheStats stats() const;
+
+private:
+    enum class Kind : uint8_t { traces, average_latency };
+
+    struct Key {
+        Kind kind;
+        // start and end node for traces(), the trace for average_latency()
+        vector<Vertex> vertices;
+        int min_hops = 0;
+        int max_hops = 0;
+        int max_latency = 0;
+
+        friend bool operator==(const Key&, const Key&) = default;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    using Result = variant<shared_ptr<const Traces>, optional<int>>;
+
+    struct Entry {
+        Key key;
+        Result result;
+        size_t bytes;
+    };
+
+    struct Shard {
+        mutable mutex m{};
+        uint64_t version = 0;
+        // most recently used first
+        list<Entry> entries{};
+        unordered_map<Key, typename list<Entry>::iterator, KeyHash> index{};
+        size_t bytes = 0;
+        QueryCacheStats stats{};
+    };
+
+    size_t max_shard_bytes;
+    vector<unique_ptr<Shard>> shards;
+
+    // the result of key if it is cached for version, after dropping the
+    // entries of older versions
+    optional<Result> find(const Key& key, size_t hash, uint64_t version);
+    void insert(Key key, size_t hash, uint64_t version, Result result, size_t bytes);
+    static void invalidate(Shard& shard, uint64_t version);
+};
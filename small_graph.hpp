@@ -0,0 +1,203 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+#include "distributed_tracing.hpp"
+
+using namespace std;
+
+// A graph of at most MaxVertices <= 64 vertices for the small per-team
+// subgraphs: the out-edges of a vertex are one 64-bit mask over the vertex
+// ids and the latencies a fixed matrix, so the hop-bounded queries take a few
+// bit operations per vertex and hop. Everything is constexpr, so a fixed
+// topology can be checked with static_assert. As in Graph, vertex ids are
+// given in order of first appearance and a repeated edge keeps its first
+// latency.
+template <regular Vertex, size_t MaxVertices = 64>
+    requires(MaxVertices <= 64)
+class SmallGraph {
+public:
+    constexpr SmallGraph() = default;
+    // from edges like those of Graph, pairs of a vertex pair and a latency
+    template <ranges::input_range Edges>
+    constexpr explicit SmallGraph(const Edges& edges) {
+        for (const auto& [nodes, latency] : edges) {
+            add_edge(nodes.first, nodes.second, latency);
+        }
+    }
+
+    // Throws length_error if the edge would add a vertex too many.
+    constexpr void add_edge(const Vertex& source, const Vertex& target, const int latency) {
+        const auto u = intern(source);
+        const auto v = intern(target);
+        if ((adjacency[u] >> v & 1) == 0) {
+            adjacency[u] |= uint64_t{1} << v;
+            latencies[u][v] = latency;
+        }
+    }
+
+    [[nodiscard]] constexpr size_t size() const { return n; }
+    [[nodiscard]] constexpr span<const Vertex> vertices() const { return {names.data(), n}; }
+
+    [[nodiscard]] constexpr optional<uint32_t> vertex_id(const Vertex& v) const {
+        for (uint32_t id = 0; id < n; id++) {
+            if (names[id] == v) {
+                return id;
+            }
+        }
+        return nullopt;
+    }
+
+    // Graph::average_latency() of a range of vertices
+    template <ranges::input_range Trace>
+    [[nodiscard]] constexpr optional<int> average_latency(const Trace& trace) const {
+        optional<uint32_t> source{};
+        int latency = 0;
+        bool first = true;
+        for (const auto& vertex : trace) {
+            const auto target = vertex_id(vertex);
+            if (!first && (!source || !target || (adjacency[*source] >> *target & 1) == 0)) {
+                return nullopt;
+            }
+            if (!first) {
+                latency += latencies[*source][*target];
+            }
+            source = target;
+            first = false;
+        }
+        return first ? nullopt : optional<int>(latency);
+    }
+
+    // The mask of the vertex ids reached from start_node by traces of 1 to
+    // max_hops hops; each hop only expands the vertices not reached before.
+    [[nodiscard]] constexpr uint64_t reachable(const Vertex& start_node, const int max_hops) const {
+        const auto start_id = vertex_id(start_node);
+        if (!start_id) {
+            return 0;
+        }
+        uint64_t seen = 0;
+        uint64_t frontier = uint64_t{1} << *start_id;
+        for (int hops = 0; hops < max_hops && frontier != 0; hops++) {
+            uint64_t next = 0;
+            for (auto rest = frontier; rest != 0; rest &= rest - 1) {
+                next |= adjacency[countr_zero(rest)];
+            }
+            frontier = next & ~seen;
+            seen |= next;
+        }
+        return seen;
+    }
+
+    [[nodiscard]] constexpr bool reaches(const Vertex& start_node, const Vertex& end_node, const int max_hops) const {
+        const auto end_id = vertex_id(end_node);
+        return end_id && (reachable(start_node, max_hops) >> *end_id & 1) != 0;
+    }
+
+    [[nodiscard]] constexpr int count_reachable(const Vertex& start_node, const int max_hops) const {
+        return popcount(reachable(start_node, max_hops));
+    }
+
+    // Graph::count_traces() without a latency bound: the walks ending in every
+    // vertex, hop by hop, pushed along the set bits of the vertices that have
+    // any. Throws overflow_error if the count does not fit into 64 bits.
+    [[nodiscard]] constexpr uint64_t count_traces(const Vertex& start_node, const Vertex& end_node, const int min_hops,
+                                                  const int max_hops) const {
+        const auto start_id = vertex_id(start_node);
+        const auto end_id = vertex_id(end_node);
+        if (!start_id || !end_id) {
+            return 0;
+        }
+        array<uint64_t, MaxVertices> walks{};
+        walks[*start_id] = 1;
+        uint64_t frontier = uint64_t{1} << *start_id;
+        uint64_t ret = 0;
+        for (int hops = 1; hops <= max_hops && frontier != 0; hops++) {
+            array<uint64_t, MaxVertices> next{};
+            uint64_t next_frontier = 0;
+            for (auto rest = frontier; rest != 0; rest &= rest - 1) {
+                const auto u = countr_zero(rest);
+                next_frontier |= adjacency[u];
+                for (auto out = adjacency[u]; out != 0; out &= out - 1) {
+                    add_count(next[countr_zero(out)], walks[u]);
+                }
+            }
+            walks = next;
+            frontier = next_frontier;
+            if (hops >= min_hops) {
+                add_count(ret, walks[*end_id]);
+            }
+        }
+        return ret;
+    }
+
+private:
+    array<Vertex, MaxVertices> names{};
+    size_t n = 0;
+    array<uint64_t, MaxVertices> adjacency{};
+    array<array<int, MaxVertices>, MaxVertices> latencies{};
+
+    constexpr uint32_t intern(const Vertex& v) {
+        if (const auto id = vertex_id(v)) {
+            return *id;
+        }
+        if (n == MaxVertices) {
+            throw length_error("SmallGraph has room for " + std::to_string(MaxVertices) + " vertices");
+        }
+        names[n] = v;
+        return static_cast<uint32_t>(n++);
+    }
+
+    static constexpr void add_count(uint64_t& count, const uint64_t n) {
+        if (__builtin_add_overflow(count, n, &count)) {
+            throw overflow_error("trace count does not fit into 64 bits");
+        }
+    }
+};
+
+// from_edges_str() into a SmallGraph, also at compile time. Throws
+// edge_parse_error for a malformed record and length_error for too many
+// vertices.
+template <size_t MaxVertices = 64>
+constexpr SmallGraph<char, MaxVertices> small_from_edges_str(const string_view edges_str) {
+    const auto is_separator = [](char c) { return c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+    const auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+    SmallGraph<char, MaxVertices> ret{};
+    size_t p = 0;
+    while (p != edges_str.size()) {
+        if (is_separator(edges_str[p])) {
+            ++p;
+            continue;
+        }
+        const auto offset = p;
+        if (edges_str.size() - p < 3 || is_separator(edges_str[p + 1])) {
+            throw edge_parse_error{offset, "expected two vertices and a latency"};
+        }
+        p += 2;
+        // from_chars is not constexpr in C++20
+        const auto negative = edges_str[p] == '-';
+        p += negative ? 1 : 0;
+        if (p == edges_str.size() || !is_digit(edges_str[p])) {
+            throw edge_parse_error{offset + 2, "expected a latency"};
+        }
+        int64_t latency = 0;
+        for (; p != edges_str.size() && is_digit(edges_str[p]); ++p) {
+            latency = latency * 10 + (edges_str[p] - '0');
+            if (latency > int64_t{numeric_limits<int>::max()} + (negative ? 1 : 0)) {
+                throw edge_parse_error{offset + 2, "latency out of range"};
+            }
+        }
+        if (p != edges_str.size() && !is_separator(edges_str[p])) {
+            throw edge_parse_error{offset + 2, "expected a latency"};
+        }
+        ret.add_edge(edges_str[offset], edges_str[offset + 1], static_cast<int>(negative ? -latency : latency));
+    }
+    return ret;
+}
@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <map>
+#include <optional>
+#include <tuple>
+
+#include "span_ingest.hpp"
+
+using namespace std;
+
+// Per-edge statistics in open addressing with a fixed number of slots. A
+// slot's key is claimed by compare-and-swap and never given up again, and its
+// statistics are updated with atomics, so observations never wait and the
+// table can be read while it is written.
+class SpanIngestor::EdgeTable {
+public:
+    explicit EdgeTable(const size_t capacity) : slots(capacity) {}
+
+    // false if the edge is new and there is no slot left for it
+    bool add(const uint64_t key, const int64_t duration) {
+        const auto shift = 64 - countr_zero(slots.size());
+        auto slot = (key * 0x9e3779b97f4a7c15) >> shift;
+        for (size_t k = 0; k < slots.size(); k++, slot = (slot + 1) & (slots.size() - 1)) {
+            auto& s = slots[slot];
+            auto current = s.key.load(memory_order_relaxed);
+            if (current == 0 && s.key.compare_exchange_strong(current, key, memory_order_relaxed)) {
+                n_used.fetch_add(1, memory_order_relaxed);
+                current = key;
+            }
+            if (current != key) {
+                continue;
+            }
+            s.count.fetch_add(1, memory_order_relaxed);
+            s.sum.fetch_add(duration, memory_order_relaxed);
+            for (auto m = s.min.load(memory_order_relaxed);
+                 duration < m && !s.min.compare_exchange_weak(m, duration, memory_order_relaxed);) {
+            }
+            for (auto m = s.max.load(memory_order_relaxed);
+                 duration > m && !s.max.compare_exchange_weak(m, duration, memory_order_relaxed);) {
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // the slots claimed by an edge
+    [[nodiscard]] size_t used() const { return n_used.load(memory_order_relaxed); }
+
+    // Adds the statistics of every edge to totals, starting them over if reset
+    // is set. An observation racing with a reset may count towards either
+    // side, with its duration and count split in the worst case.
+    void collect(map<uint64_t, EdgeStats>& totals, const bool reset) {
+        for (auto& s : slots) {
+            const auto key = s.key.load(memory_order_relaxed);
+            if (key == 0) {
+                continue;
+            }
+            const auto count = reset ? s.count.exchange(0, memory_order_relaxed) : s.count.load(memory_order_relaxed);
+            const auto sum = reset ? s.sum.exchange(0, memory_order_relaxed) : s.sum.load(memory_order_relaxed);
+            const auto min = reset ? s.min.exchange(numeric_limits<int64_t>::max(), memory_order_relaxed)
+                                   : s.min.load(memory_order_relaxed);
+            const auto max = reset ? s.max.exchange(numeric_limits<int64_t>::min(), memory_order_relaxed)
+                                   : s.max.load(memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+            auto [it, inserted] = totals.try_emplace(key, EdgeStats{ServiceId{static_cast<uint32_t>((key - 1) >> 32)},
+                                                                    ServiceId{static_cast<uint32_t>(key - 1)}, 0, 0,
+                                                                    numeric_limits<int64_t>::max(),
+                                                                    numeric_limits<int64_t>::min()});
+            it->second.count += count;
+            it->second.sum += sum;
+            it->second.min = std::min(it->second.min, min);
+            it->second.max = std::max(it->second.max, max);
+        }
+    }
+
+private:
+    // one cache line per slot, so that neighbouring edges do not contend
+    struct alignas(64) Slot {
+        // source << 32 | target, plus one so that 0 is free
+        atomic<uint64_t> key{0};
+        atomic<uint64_t> count{0};
+        atomic<int64_t> sum{0};
+        atomic<int64_t> min{numeric_limits<int64_t>::max()};
+        atomic<int64_t> max{numeric_limits<int64_t>::min()};
+    };
+
+    vector<Slot> slots;
+    atomic<size_t> n_used{0};
+};
+
+// The spans of the traces hashed to one shard that are still in the join
+// window. A shard is only ever worked on by one task at a time.
+struct SpanIngestor::JoinShard {
+    struct Seen {
+        ServiceId service;
+        int64_t start;
+    };
+    struct Orphan {
+        ServiceId service;
+        int64_t start;
+        int64_t duration;
+    };
+    using Key = pair<uint64_t, uint64_t>;
+
+    // by trace and span id, for the children still to come
+    unordered_map<Key, Seen, pair_hash> seen{};
+    // by trace and parent span id, the children whose parent has not come
+    unordered_multimap<Key, Orphan, pair_hash> orphans{};
+    // the entries of both in order of arrival, to drop them from the front
+    // once they fall out of the window; an orphan's entry may be stale
+    deque<tuple<int64_t, Key, bool>> arrivals{};
+    atomic<uint64_t> joined{0};
+    atomic<uint64_t> expired{0};
+    atomic<uint64_t> dropped{0};
+};
+
+SpanIngestor::SpanIngestor(const SpanIngestOptions& options)
+    : options{options}, pool{options.pool != nullptr ? options.pool : &default_pool()} {
+    if (!has_single_bit(options.max_edges)) {
+        throw invalid_argument("max_edges must be a power of two");
+    }
+    for (size_t k = 0; k < max<size_t>(options.join_shards, 1); k++) {
+        join_shards.push_back(make_unique<JoinShard>());
+    }
+    for (unsigned k = 0; k < pool->size(); k++) {
+        edge_tables.push_back(make_unique<EdgeTable>(options.max_edges));
+    }
+}
+
+SpanIngestor::~SpanIngestor() = default;
+
+void SpanIngestor::ingest(const span<const SpanRecord> spans) {
+    if (spans.empty()) {
+        return;
+    }
+    for (const auto& s : spans) {
+        watermark = max(watermark, s.start);
+    }
+    by_shard.resize(join_shards.size());
+    for (auto& indices : by_shard) {
+        indices.clear();
+    }
+    for (uint32_t i = 0; i < spans.size(); i++) {
+        by_shard[(spans[i].trace_id * 0x9e3779b97f4a7c15 >> 32) % join_shards.size()].push_back(i);
+    }
+
+    const auto window = options.window;
+    const auto horizon = watermark < numeric_limits<int64_t>::min() + window ? numeric_limits<int64_t>::min()
+                                                                            : watermark - window;
+    pool->run(join_shards.size(), [&](const size_t k, const unsigned worker) {
+        auto& shard = *join_shards[k];
+        auto& edges = *edge_tables[worker];
+        const auto observe = [&](const ServiceId parent, const ServiceId child, const int64_t duration) {
+            const auto key = (uint64_t{parent.value} << 32 | child.value) + 1;
+            if (edges.add(key, duration)) {
+                shard.joined.fetch_add(1, memory_order_relaxed);
+            } else {
+                shard.dropped.fetch_add(1, memory_order_relaxed);
+            }
+        };
+        for (const auto i : by_shard[k]) {
+            const auto& s = spans[i];
+            if (s.parent_id != 0) {
+                const auto parent = shard.seen.find({s.trace_id, s.parent_id});
+                if (parent != shard.seen.end() && abs(s.start - parent->second.start) <= window) {
+                    observe(parent->second.service, s.service, s.duration);
+                } else {
+                    shard.orphans.emplace(JoinShard::Key{s.trace_id, s.parent_id},
+                                          JoinShard::Orphan{s.service, s.start, s.duration});
+                    shard.arrivals.emplace_back(s.start, JoinShard::Key{s.trace_id, s.parent_id}, true);
+                }
+            }
+            const auto [first, last] = shard.orphans.equal_range({s.trace_id, s.span_id});
+            for (auto it = first; it != last; ++it) {
+                if (abs(it->second.start - s.start) <= window) {
+                    observe(s.service, it->second.service, it->second.duration);
+                }
+            }
+            shard.orphans.erase(first, last);
+            shard.seen.insert_or_assign({s.trace_id, s.span_id}, JoinShard::Seen{s.service, s.start});
+            shard.arrivals.emplace_back(s.start, JoinShard::Key{s.trace_id, s.span_id}, false);
+        }
+
+        // drop what fell out of the window or does not fit
+        while (!shard.arrivals.empty() &&
+               (get<0>(shard.arrivals.front()) < horizon || shard.arrivals.size() > options.max_pending)) {
+            const auto [start, key, orphan] = shard.arrivals.front();
+            shard.arrivals.pop_front();
+            if (!orphan) {
+                if (const auto it = shard.seen.find(key); it != shard.seen.end() && it->second.start == start) {
+                    shard.seen.erase(it);
+                }
+                continue;
+            }
+            const auto [first, last] = shard.orphans.equal_range(key);
+            const auto it = find_if(first, last, [start](const auto& entry) { return entry.second.start == start; });
+            if (it != last) {
+                shard.orphans.erase(it);
+                shard.expired.fetch_add(1, memory_order_relaxed);
+            }
+        }
+    });
+    n_spans.fetch_add(spans.size(), memory_order_relaxed);
+}
+
+// One span record of a line of ingest_text(), interning its service.
+static optional<SpanRecord> parse_span(string_view line, ServiceNames& names) {
+    const auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+    array<string_view, 6> fields{};
+    size_t n_fields = 0;
+    for (size_t p = 0; p < line.size();) {
+        if (is_space(line[p])) {
+            ++p;
+            continue;
+        }
+        auto end = p;
+        while (end < line.size() && !is_space(line[end])) {
+            ++end;
+        }
+        if (n_fields == fields.size()) {
+            return nullopt;
+        }
+        fields[n_fields++] = line.substr(p, end - p);
+        p = end;
+    }
+    if (n_fields != fields.size()) {
+        return nullopt;
+    }
+    const auto parse = [](string_view field, auto& value, int base) {
+        const auto [end, ec] = from_chars(field.data(), field.data() + field.size(), value, base);
+        return ec == errc{} && end == field.data() + field.size();
+    };
+    SpanRecord ret{};
+    if (!parse(fields[0], ret.trace_id, 16) || !parse(fields[1], ret.span_id, 16) ||
+        (fields[2] != "-" && !parse(fields[2], ret.parent_id, 16)) || !parse(fields[4], ret.start, 10) ||
+        !parse(fields[5], ret.duration, 10)) {
+        return nullopt;
+    }
+    ret.service = names.intern(fields[3]);
+    return ret;
+}
+
+size_t SpanIngestor::ingest_text(const string_view text) {
+    parsed.clear();
+    size_t consumed = 0;
+    for (auto newline = text.find('\n'); newline != string_view::npos; newline = text.find('\n', consumed)) {
+        const auto line = text.substr(consumed, newline - consumed);
+        consumed = newline + 1;
+        if (line.find_first_not_of(" \t\r") == string_view::npos) {
+            continue;
+        }
+        if (const auto record = parse_span(line, names_)) {
+            parsed.push_back(*record);
+        } else {
+            n_malformed.fetch_add(1, memory_order_relaxed);
+        }
+    }
+    ingest(parsed);
+    return consumed;
+}
+
+vector<SpanIngestor::EdgeStats> SpanIngestor::edge_stats() const {
+    map<uint64_t, EdgeStats> totals{};
+    for (const auto& table : edge_tables) {
+        table->collect(totals, false);
+    }
+    vector<EdgeStats> ret{};
+    for (const auto& [key, stats] : totals) {
+        ret.push_back(stats);
+    }
+    return ret;
+}
+
+ServiceGraph SpanIngestor::graph(const bool reset) {
+    const lock_guard lock{graph_mutex};
+    map<uint64_t, EdgeStats> totals{};
+    for (const auto& table : edge_tables) {
+        table->collect(totals, reset);
+    }
+    for (const auto& [key, stats] : totals) {
+        const auto mean = llround(static_cast<double>(stats.sum) / static_cast<double>(stats.count));
+        last_latencies.insert_or_assign(key, tuple{stats.source, stats.target,
+                                                   static_cast<int>(clamp<long long>(mean, 0, numeric_limits<int>::max()))});
+    }
+    GraphBuilder<ServiceId> builder{};
+    builder.reserve(last_latencies.size());
+    for (const auto& [key, edge] : last_latencies) {
+        const auto& [source, target, latency] = edge;
+        builder.add_edge(source, target, latency);
+    }
+    return ServiceGraph{move(builder)};
+}
+
+SpanIngestStats SpanIngestor::stats() const {
+    SpanIngestStats ret{n_spans.load(memory_order_relaxed), 0, n_malformed.load(memory_order_relaxed), 0, 0};
+    for (const auto& shard : join_shards) {
+        ret.joined += shard->joined.load(memory_order_relaxed);
+        ret.expired += shard->expired.load(memory_order_relaxed);
+        ret.dropped += shard->dropped.load(memory_order_relaxed);
+    }
+    for (const auto& table : edge_tables) {
+        ret.edges = max<uint64_t>(ret.edges, table->used());
+    }
+    return ret;
+}
+
+void ingest_spans(istream& in, SpanIngestor& ingestor, const uint64_t emit_every,
+                  const function<void(ServiceGraph)>& emit, const size_t batch_bytes) {
+    // the unconsumed partial line of a batch moves to the front of the next
+    string buffer(batch_bytes, '\0');
+    size_t kept = 0;
+    auto last_emit = ingestor.stats().spans;
+    while (in) {
+        if (kept == buffer.size()) {
+            // a line longer than a batch
+            buffer.resize(2 * buffer.size());
+        }
+        in.read(buffer.data() + kept, static_cast<streamsize>(buffer.size() - kept));
+        const auto filled = kept + static_cast<size_t>(in.gcount());
+        if (!in && filled > 0 && buffer[filled - 1] != '\n') {
+            // the last line of the input has no newline
+            buffer.resize(max(buffer.size(), filled + 1));
+            buffer[filled] = '\n';
+            ingestor.ingest_text(string_view{buffer.data(), filled + 1});
+            kept = 0;
+        } else {
+            const auto consumed = ingestor.ingest_text(string_view{buffer.data(), filled});
+            copy(buffer.begin() + static_cast<ptrdiff_t>(consumed), buffer.begin() + static_cast<ptrdiff_t>(filled),
+                 buffer.begin());
+            kept = filled - consumed;
+        }
+        if (const auto spans = ingestor.stats().spans; spans - last_emit >= emit_every && in) {
+            emit(ingestor.graph(true));
+            last_emit = spans;
+        }
+    }
+    emit(ingestor.graph(true));
+}
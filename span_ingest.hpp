@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "distributed_tracing.hpp"
+#include "work_stealing_pool.hpp"
+
+using namespace std;
+
+// One span of a distributed trace: service handled a call that started at
+// start and took duration, both in microseconds. A root span has a parent id
+// of 0.
+struct SpanRecord {
+    uint64_t trace_id;
+    uint64_t span_id;
+    uint64_t parent_id;
+    ServiceId service;
+    int64_t start;
+    int64_t duration;
+};
+
+struct SpanIngestOptions {
+    // how much later than its parent, or the other way round, a span may start
+    // and still be joined with it
+    int64_t window = 60'000'000;
+    // spans a join shard keeps waiting for their parent or children, beyond
+    // which the oldest are dropped
+    size_t max_pending = 1 << 18;
+    size_t join_shards = 64;
+    // distinct edges every accumulator shard can hold, a power of two
+    size_t max_edges = 1 << 14;
+    // a null pool means default_pool()
+    WorkStealingPool* pool = nullptr;
+};
+
+struct SpanIngestStats {
+    uint64_t spans = 0;
+    // parent-child pairs joined into an edge observation
+    uint64_t joined = 0;
+    // lines that are not a span record
+    uint64_t malformed = 0;
+    // spans dropped from the join window before their parent came
+    uint64_t expired = 0;
+    // observations of edges that did not fit into an accumulator shard
+    uint64_t dropped = 0;
+    // the distinct edges held by the fullest accumulator shard; once that is
+    // max_edges, the shard drops every observation of a new edge
+    uint64_t edges = 0;
+};
+
+// Turns a stream of spans into a ServiceGraph. Every span is joined with its
+// parent, which may arrive before or after it as long as their starts are at
+// most the window apart, into an observation of the edge from the parent's
+// service to the child's with the child's duration as latency. The joins are
+// sharded by trace id and run in parallel on the pool, and the per-edge
+// statistics go into fixed-size lock-free hash tables, one per worker, so
+// memory stays bounded however long the stream is. An edge keeps its slot for
+// the life of the ingestor, resets included: once a table holds max_edges
+// edges, new edges observed by its worker are dropped for good, which shows
+// in stats().edges and stats().dropped.
+class SpanIngestor {
+public:
+    explicit SpanIngestor(const SpanIngestOptions& options = {});
+    ~SpanIngestor();
+    SpanIngestor(const SpanIngestor&) = delete;
+    SpanIngestor& operator=(const SpanIngestor&) = delete;
+
+    // Parses and ingests the complete lines of text and returns how many bytes
+    // they take, leaving a trailing partial line for the next call. A line is
+    // a hexadecimal trace id, span id and parent span id (0 or - for a root),
+    // a service name, and a decimal start and duration, separated by spaces or
+    // tabs. Malformed lines are counted and skipped.
+    size_t ingest_text(string_view text);
+    void ingest(span<const SpanRecord> spans);
+
+    // A graph of the edges observed so far with their mean latency, rounded.
+    // If reset is set, the statistics start over, so the next graph has the
+    // means of what was observed since; an edge not observed since keeps the
+    // latency it had in the last graph. May run while another thread ingests.
+    [[nodiscard]] ServiceGraph graph(bool reset = false);
+
+    struct EdgeStats {
+        ServiceId source;
+        ServiceId target;
+        uint64_t count;
+        int64_t sum;
+        int64_t min;
+        int64_t max;
+    };
+    // the statistics of every edge observed so far, summed over the shards
+    [[nodiscard]] vector<EdgeStats> edge_stats() const;
+
+    // Services are interned by ingest_text(), which must not run meanwhile.
+    [[nodiscard]] ServiceNames& names() { return names_; }
+    [[nodiscard]] const ServiceNames& names() const { return names_; }
+    [[nodiscard]] SpanIngestStats stats() const;
+
+private:
+    struct JoinShard;
+    class EdgeTable;
+
+    SpanIngestOptions options;
+    WorkStealingPool* pool;
+    ServiceNames names_{};
+    vector<unique_ptr<JoinShard>> join_shards{};
+    vector<unique_ptr<EdgeTable>> edge_tables{};
+    // the latest latency graph() gave every edge, by edge table key
+    mutex graph_mutex{};
+    map<uint64_t, tuple<ServiceId, ServiceId, int>> last_latencies{};
+    // the latest start seen, which spans older than the window fall behind
+    int64_t watermark = numeric_limits<int64_t>::min();
+    vector<SpanRecord> parsed{};
+    vector<vector<uint32_t>> by_shard{};
+    atomic<uint64_t> n_spans{0};
+    atomic<uint64_t> n_malformed{0};
+};
+
+// Ingests in until its end, reading batch_bytes at a time, and hands emit a
+// graph after every emit_every spans and once at the end. The graph holds
+// every edge observed so far, with its mean latency in the latest of these
+// windows that observed it. Works on files and std::cin alike.
+void ingest_spans(istream& in, SpanIngestor& ingestor, uint64_t emit_every, const function<void(ServiceGraph)>& emit,
+                  size_t batch_bytes = 1 << 20);
@@ -0,0 +1,124 @@
+
+#include "work_stealing_pool.hpp"
+
+using namespace std;
+
+WorkStealingPool::WorkStealingPool(const unsigned n_threads) {
+    for (unsigned i = 0; i < n_threads; i++) {
+        queues.emplace_back(make_unique<Queue>());
+    }
+    for (unsigned i = 0; i < n_threads; i++) {
+        workers.emplace_back([this, i](const stop_token& stop) { work(stop, i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    for (auto& worker : workers) {
+        worker.request_stop();
+    }
+    {
+        lock_guard lock{m};
+        started.notify_all();
+    }
+    workers.clear();
+}
+
+void WorkStealingPool::run(const size_t n_tasks, const function<void(size_t, unsigned)>& task) {
+    if (n_tasks == 0) {
+        return;
+    }
+    const lock_guard submit_lock{submit};
+    unique_lock lock{m};
+    // deal out contiguous blocks so that neighbouring tasks share a worker
+    // until stealing moves them
+    const auto n = queues.size();
+    for (size_t w = 0; w < n; w++) {
+        lock_guard queue_lock{queues[w]->m};
+        for (auto i = w * n_tasks / n; i < (w + 1) * n_tasks / n; i++) {
+            queues[w]->tasks.push_back(i);
+        }
+    }
+    job = &task;
+    error = nullptr;
+    busy = static_cast<unsigned>(n);
+    round += 1;
+    started.notify_all();
+    finished.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+    if (error) {
+        rethrow_exception(error);
+    }
+}
+
+void WorkStealingPool::work(const stop_token& stop, const unsigned worker) {
+    uint64_t seen_round = 0;
+    while (true) {
+        const function<void(size_t, unsigned)>* task = nullptr;
+        {
+            unique_lock lock{m};
+            started.wait(lock, [&] { return stop.stop_requested() || round != seen_round; });
+            if (stop.stop_requested()) {
+                return;
+            }
+            seen_round = round;
+            task = job;
+        }
+
+        size_t i;
+        while (next_task(worker, i)) {
+            try {
+                (*task)(i, worker);
+            } catch (...) {
+                lock_guard lock{m};
+                if (!error) {
+                    error = current_exception();
+                }
+            }
+        }
+
+        // a worker only leaves the round once every deque is empty, so no
+        // task of this round can still be waiting when busy drops to zero
+        lock_guard lock{m};
+        busy -= 1;
+        if (busy == 0) {
+            finished.notify_all();
+        }
+    }
+}
+
+bool WorkStealingPool::next_task(const unsigned worker, size_t& task) {
+    {
+        auto& own = *queues[worker];
+        lock_guard lock{own.m};
+        if (!own.tasks.empty()) {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++) {
+        auto& victim = *queues[(worker + k) % queues.size()];
+        lock_guard lock{victim.m};
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+WorkStealingPool& default_pool() {
+    static WorkStealingPool pool{};
+    return pool;
+}
+
+void parallel_for(WorkStealingPool* pool, const size_t n, const function<void(size_t, size_t)>& body) {
+    if (pool == nullptr || pool->size() == 1 || n < 2) {
+        body(0, n);
+        return;
+    }
+    // a few chunks per worker leaves something to steal
+    const auto n_chunks = min(n, static_cast<size_t>(pool->size()) * 4);
+    pool->run(n_chunks, [&](size_t chunk, unsigned) { body(chunk * n / n_chunks, (chunk + 1) * n / n_chunks); });
+}
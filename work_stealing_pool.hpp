@@ -0,0 +1,63 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A fixed set of worker threads, each with its own task deque. A worker takes
+// tasks from the front of its own deque and, once that is empty, steals from
+// the back of the others', so uneven tasks balance out without a central
+// queue.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned n_threads = max(1u, thread::hardware_concurrency()));
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    [[nodiscard]] unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    // Runs task(i, worker) for every i in [0, n_tasks), where worker is the
+    // index of the running thread, and returns once all of them have finished.
+    // Rethrows the first exception a task threw. Calls from several threads
+    // take turns, each waiting for the ones before it to finish; a task must
+    // not call run() on its own pool.
+    void run(size_t n_tasks, const function<void(size_t, unsigned)>& task);
+
+private:
+    struct Queue {
+        mutex m;
+        deque<size_t> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues{};
+    vector<jthread> workers{};
+    // held by a run() for all of its round, since the round's state below is
+    // shared by all callers
+    mutex submit{};
+    mutex m{};
+    condition_variable started{};
+    condition_variable finished{};
+    const function<void(size_t, unsigned)>* job = nullptr;
+    uint64_t round = 0;
+    unsigned busy = 0;
+    exception_ptr error{};
+
+    void work(const stop_token& stop, unsigned worker);
+    bool next_task(unsigned worker, size_t& task);
+};
+
+// The pool shared by parallel queries that are not given one.
+WorkStealingPool& default_pool();
+
+// Calls body(begin, end) on consecutive chunks covering [0, n), in parallel
+// on pool or inline when pool is null.
+void parallel_for(WorkStealingPool* pool, size_t n, const function<void(size_t, size_t)>& body);